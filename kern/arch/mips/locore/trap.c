@@ -214,13 +214,20 @@ mips_trap(struct trapframe *tf)
 						+ STACK_SIZE));
 	}
 
+	/* Faults in copyin/copyout check against the user's stack. */
+	if (!iskern) {
+		curthread->t_usersp = tf->tf_sp;
+	}
+
 	/* Interrupt? Call the interrupt handler and return. */
 	if (code == EX_IRQ) {
 		int old_in;
-		bool doadjust;
+		bool old_user, doadjust;
 
 		old_in = curthread->t_in_interrupt;
+		old_user = curthread->t_intr_user;
 		curthread->t_in_interrupt = 1;
+		curthread->t_intr_user = !iskern;
 
 		/*
 		 * The processor has turned interrupts off; if the
@@ -260,6 +267,7 @@ mips_trap(struct trapframe *tf)
 		}
 
 		curthread->t_in_interrupt = old_in;
+		curthread->t_intr_user = old_user;
 		goto done2;
 	}
 
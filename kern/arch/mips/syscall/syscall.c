@@ -31,10 +31,13 @@
 #include <kern/errno.h>
 #include <kern/syscall.h>
 #include <lib.h>
+#include <endian.h>
+#include <copyinout.h>
 #include <mips/trapframe.h>
 #include <thread.h>
 #include <current.h>
 #include <syscall.h>
+#include "opt-A3.h"
 
 /*
  * System call dispatcher.
@@ -79,6 +82,8 @@ syscall(struct trapframe *tf)
 {
 	int callno;
 	int32_t retval;
+	off_t retval64;
+	bool ret64;
 	int err;
 
 	KASSERT(curthread != NULL);
@@ -97,6 +102,8 @@ syscall(struct trapframe *tf)
 	 */
 
 	retval = 0;
+	retval64 = 0;
+	ret64 = false;
 
 	switch (callno) {
 	    case SYS_reboot:
@@ -108,12 +115,88 @@ syscall(struct trapframe *tf)
 				 (userptr_t)tf->tf_a1);
 		break;
 #ifdef UW
+	case SYS_open:
+	  err = sys_open((userptr_t)tf->tf_a0,
+			 (int)tf->tf_a1,
+			 (mode_t)tf->tf_a2,
+			 (int *)(&retval));
+	  break;
+	case SYS_close:
+	  err = sys_close((int)tf->tf_a0);
+	  break;
+	case SYS_pipe:
+	  err = sys_pipe((userptr_t)tf->tf_a0);
+	  break;
+	case SYS_dup2:
+	  err = sys_dup2((int)tf->tf_a0,
+			 (int)tf->tf_a1,
+			 (int *)(&retval));
+	  break;
+	case SYS_read:
+	  err = sys_read((int)tf->tf_a0,
+			 (userptr_t)tf->tf_a1,
+			 (int)tf->tf_a2,
+			 (int *)(&retval));
+	  break;
 	case SYS_write:
 	  err = sys_write((int)tf->tf_a0,
 			  (userptr_t)tf->tf_a1,
 			  (int)tf->tf_a2,
 			  (int *)(&retval));
 	  break;
+	case SYS_pread:
+	case SYS_pwrite:
+	  /* the 64-bit position is on the stack, since a3 isn't aligned */
+	  {
+	    off_t pos;
+
+	    err = copyin((userptr_t)(tf->tf_sp + 16), &pos, sizeof(pos));
+	    if (err) {
+	      break;
+	    }
+	    if (callno == SYS_pread) {
+	      err = sys_pread((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+			      (size_t)tf->tf_a2, pos, (int *)(&retval));
+	    }
+	    else {
+	      err = sys_pwrite((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+			       (size_t)tf->tf_a2, pos, (int *)(&retval));
+	    }
+	  }
+	  break;
+	case SYS_readv:
+	  err = sys_readv((int)tf->tf_a0,
+			  (userptr_t)tf->tf_a1,
+			  (int)tf->tf_a2,
+			  (int *)(&retval));
+	  break;
+	case SYS_writev:
+	  err = sys_writev((int)tf->tf_a0,
+			   (userptr_t)tf->tf_a1,
+			   (int)tf->tf_a2,
+			   (int *)(&retval));
+	  break;
+	case SYS_lseek:
+	  /*
+	   * The 64-bit offset is in a2/a3 (a1 is skipped to align
+	   * it), whence is on the stack, and the 64-bit result goes
+	   * back in v0/v1.
+	   */
+	  {
+	    uint64_t pos;
+	    int whence;
+
+	    join32to64(tf->tf_a2, tf->tf_a3, &pos);
+	    err = copyin((userptr_t)(tf->tf_sp + 16), &whence, sizeof(whence));
+	    if (err == 0) {
+	      err = sys_lseek((int)tf->tf_a0, (off_t)pos, whence, &retval64);
+	      ret64 = true;
+	    }
+	  }
+	  break;
+	case SYS_fsync:
+	  err = sys_fsync((int)tf->tf_a0);
+	  break;
 	case SYS__exit:
 	  sys__exit((int)tf->tf_a0);
 	  /* sys__exit does not return, execution should not get here */
@@ -136,7 +219,26 @@ syscall(struct trapframe *tf)
 	  case SYS_execv:
 		err = sys_execv((const char *) tf->tf_a0, (char **) tf->tf_a1);
 		break;
+	case SYS_getrusage:
+	  err = sys_getrusage((int)tf->tf_a0, (userptr_t)tf->tf_a1);
+	  break;
+	case SYS_setaffinity:
+	  err = sys_setaffinity((pid_t)tf->tf_a0, (uint32_t)tf->tf_a1);
+	  break;
 #endif // UW
+#if OPT_A3
+	case SYS_sbrk:
+	  err = sys_sbrk((intptr_t)tf->tf_a0, (vaddr_t *)&retval);
+	  break;
+	case SYS_mmap:
+	  err = sys_mmap((vaddr_t)tf->tf_a0, (size_t)tf->tf_a1,
+			 (int)tf->tf_a2, (int)tf->tf_a3,
+			 (userptr_t)(tf->tf_sp + 16), (vaddr_t *)&retval);
+	  break;
+	case SYS_munmap:
+	  err = sys_munmap((vaddr_t)tf->tf_a0, (size_t)tf->tf_a1);
+	  break;
+#endif
 
 
 	    /* Add stuff here */
@@ -159,7 +261,12 @@ syscall(struct trapframe *tf)
 	}
 	else {
 		/* Success. */
-		tf->tf_v0 = retval;
+		if (ret64) {
+			split64to32(retval64, &tf->tf_v0, &tf->tf_v1);
+		}
+		else {
+			tf->tf_v0 = retval;
+		}
 		tf->tf_a3 = 0;      /* signal no error */
 	}
 	
@@ -40,20 +40,21 @@
 #include "opt-A3.h"
 #include <synch.h>
 #include <copyinout.h>
+#if OPT_A3
+#include <coremap.h>
+#include <uw-vmstats.h>
+#endif
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
  * enough to struggle off the ground.
  */
 
+#if !OPT_A3
 /* under dumbvm, always have 48k of user stack */
 #define DUMBVM_STACKPAGES    12
+#endif
 
-static int *coremap;
-static int coremap_created = 0;
-static int total_frames;
-static struct lock *coremap_lock;
-static paddr_t first_addr, last_addr;
 /*
  * Wrap rma_stealmem in a spinlock.
  */
@@ -62,32 +63,11 @@ static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 void
 vm_bootstrap(void)
 {
-	#if OPT_A3
-	coremap_lock = lock_create("coremap_lock");
-	lock_acquire(coremap_lock);
-
-	ram_getsize(&first_addr, &last_addr);
-	coremap = (int*)PADDR_TO_KVADDR(first_addr);
-	//total number of frames
-	total_frames = (last_addr - first_addr) / PAGE_SIZE;
-
-	//coremap size
-	int coremap_size = sizeof(int) * total_frames;
-	int coremap_frames = (coremap_size + PAGE_SIZE - 1) / PAGE_SIZE;
-	total_frames -= coremap_frames;
-
-	first_addr += coremap_frames * PAGE_SIZE;
-	KASSERT(first_addr % PAGE_SIZE == 0);
-
-	//set up coremap
-	for (int i = 0; i < total_frames; i++) {
-		coremap[i] = 0;
-	}
-
-	coremap_created = 1;
-	lock_release(coremap_lock);
-
-	#endif
+#if OPT_A3
+	coremap_bootstrap();
+	vmstats_init();
+	vm_paging_bootstrap();
+#endif
 	/* Do nothing. */
 }
 
@@ -97,41 +77,17 @@ getppages(unsigned long npages)
 {
 	paddr_t addr;
 
-	if(coremap_created == 1) {
-		lock_acquire(coremap_lock);
-		int index = 0;
-		unsigned long empty = 0;
-		while(empty < npages) {
-			if(index >= total_frames) {
-				empty = 0;
-				panic("Not enough pages\n");
-			}
-			if(coremap[index] == 0) {
-				empty++;
-				index++;
-			}else{
-				empty = 0;
-				index++;
-			}
-		}
-		int temp = index;
-		for(;index >= 0 && npages > 0; index--, npages--) {
-			coremap[index-1] = npages;
-		}
-		//////////
-		//////////
-		lock_release(coremap_lock);
-		addr = (paddr_t)(first_addr + (temp * PAGE_SIZE));
-	}else{
-
-		spinlock_acquire(&stealmem_lock);
-
-		addr = ram_stealmem(npages);
-
-		spinlock_release(&stealmem_lock);
+#if OPT_A3
+	if (coremap_ready()) {
+		return vm_getframes(npages);
 	}
+#endif
 
+	spinlock_acquire(&stealmem_lock);
+
+	addr = ram_stealmem(npages);
 	
+	spinlock_release(&stealmem_lock);
 	return addr;
 }
 
@@ -150,31 +106,15 @@ alloc_kpages(int npages)
 void 
 free_kpages(vaddr_t addr)
 {
+#if OPT_A3
+	coremap_free(addr - MIPS_KSEG0);
+#else
 	/* nothing - leak the memory. */
-	#if OPT_A3
-	lock_acquire(coremap_lock);
-	paddr_t paddr = addr - MIPS_KSEG0;
-	KASSERT(paddr % PAGE_SIZE == 0);
-	int frame_index = (paddr - first_addr) / PAGE_SIZE;
-	while(true) {
-		if (frame_index == total_frames -1) {
-			coremap[frame_index] = 0;
-			break;
-		}
-		int cur_val = coremap[frame_index];
-		int next_val = coremap[frame_index + 1];
-		if (cur_val >= next_val) {
-			coremap[frame_index] = 0;
-			break;
-		}else{
-			coremap[frame_index] = 0;
-			frame_index++;
-		}
-	}
-	lock_release(coremap_lock);
-	#endif
+	(void)addr;
+#endif
 }
 
+#if !OPT_A3
 void
 vm_tlbshootdown_all(void)
 {
@@ -188,6 +128,11 @@ vm_tlbshootdown(const struct tlbshootdown *ts)
 	panic("dumbvm tried to do tlb shootdown?!\n");
 }
 
+/*
+ * With OPT_A3 the fault handler and the address space functions come
+ * from the paging VM in arch/mips/vm/vm.c instead.
+ */
+
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
@@ -501,10 +446,20 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 }
 
 
+#endif /* !OPT_A3 */
+
 int as_define_stack_arg(struct addrspace *as, vaddr_t *stackptr, int argc, char **argv) {
 	  int result;
+#if OPT_A3
+	  vaddr_t temp_stackptr;
+	  result = as_define_stack(as, &temp_stackptr);
+	  if (result) {
+	    return result;
+	  }
+#else
 	  KASSERT(as->as_stackpbase != 0);
 	  vaddr_t temp_stackptr = USERSTACK; //tracker pointer
+#endif
 	  vaddr_t *arg_ptr = kmalloc((argc + 1) * sizeof(vaddr_t)); //array of pointer to argument srtrings on stack
 	  size_t total_string_size  = 0;
 
@@ -514,6 +469,7 @@ int as_define_stack_arg(struct addrspace *as, vaddr_t *stackptr, int argc, char
 	    size_t arg_size = arg_len * sizeof(char);
 	    total_string_size += arg_size;
 	    temp_stackptr -= arg_size; //address of start of string
+	    curthread->t_usersp = temp_stackptr; //let the stack grow to here
 
 	    result = copyout((void *)argv[i], (userptr_t) temp_stackptr, arg_len);
 	    if(result) {
@@ -534,6 +490,7 @@ int as_define_stack_arg(struct addrspace *as, vaddr_t *stackptr, int argc, char
 	  size_t total_array_size = ptr_size * (argc + 1);
 	  temp_stackptr -= total_array_size;
 	  KASSERT(temp_stackptr % 4 == 0);
+	  curthread->t_usersp = temp_stackptr;
 	  result = copyout((void *)arg_ptr, (userptr_t) temp_stackptr, total_array_size);
 	  if(result){
 	  	kfree(arg_ptr);
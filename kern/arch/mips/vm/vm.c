@@ -0,0 +1,1303 @@
+/*
+ * Paging VM for assignment 3.
+ *
+ * This replaces dumbvm's three fixed, eagerly allocated segments
+ * with a list of regions and a sparse page table per address space.
+ * Nothing is allocated when a region is defined; vm_fault hands out a
+ * frame the first time each page is touched, filled from the
+ * executable if the page lies in a segment's file image and zeroed
+ * otherwise.
+ *
+ * as_copy shares frames copy-on-write: both page tables map the same
+ * frame read-only with PTE_COW set, and the first write from either
+ * side takes a private copy (or just reclaims the frame if nobody
+ * else refers to it any more).
+ *
+ * Files mapped MAP_SHARED are mapped straight from the page cache,
+ * so every process sees the same frames. Those frames stay put while
+ * anyone maps them and are written back by munmap, fsync and exit;
+ * write() to the file goes through vm_prewrite and vm_postwrite so
+ * the cached frames don't go stale.
+ *
+ * When memory runs out, vm_getframes first has the per-cpu kmalloc
+ * magazines give back what they hold, then drops cached file pages
+ * nobody maps, then pages out user pages picked by the coremap's
+ * clock: dirty ones are written to swap, clean ones are dropped and
+ * later read in again from their file or zero-filled.
+ * Every page table change, faults included, happens under vm_lock, so
+ * eviction can safely reach into another process's page table.
+ *
+ * vm_lock is never held across file I/O. The file system holds
+ * vfs_biglock while it copies to and from user memory, and may fault
+ * or allocate memory under it, so vfs_biglock comes before vm_lock.
+ * A page being read in or written out is marked PTE_BUSY and the
+ * lock dropped for the transfer; anyone else who wants the page waits
+ * on vm_busycv. Frames for a fault are also allocated with the lock
+ * dropped, so that making room can drop it too. Swap I/O never needs
+ * vfs_biglock (see swap.h), which is what makes it safe to wait for
+ * a busy page while holding that, and lets an allocation made with
+ * vm_lock already held still evict to swap without dropping it.
+ *
+ * vm_bootstrap and alloc_kpages/free_kpages still live in dumbvm.c;
+ * once the coremap is up they get their frames from vm_getframes.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <uio.h>
+#include <spl.h>
+#include <proc.h>
+#include <current.h>
+#include <mips/tlb.h>
+#include <addrspace.h>
+#include <vnode.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <pagecache.h>
+#include <swap.h>
+#include <synch.h>
+#include <cpu.h>
+#include <kmalloc.h>
+#include <uw-vmstats.h>
+
+/*
+ * The user stack starts out VM_STACKPAGES long and grows down on
+ * fault, up to VM_STACKLIMIT bytes by default. Only faults at most
+ * VM_STACKSLACK bytes below the stack pointer grow it; anything
+ * further down is a stray pointer.
+ */
+#define VM_STACKPAGES    2
+#define VM_STACKLIMIT    (1024 * 1024)
+#define VM_STACKSLACK    64
+
+static struct lock *vm_lock;
+static struct cv *vm_busycv;		/* a PTE_BUSY page is done */
+static struct semaphore *vm_shootdown_sem;
+
+/* Source of address space TLB generations; 0 means none. */
+static struct spinlock as_genlock = SPINLOCK_INITIALIZER;
+static uint32_t as_nextgen = 1;
+
+/*
+ * Invalidate every entry in this cpu's TLB.
+ */
+static
+void
+tlb_flush(void)
+{
+	int i, spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	curcpu->c_tlb_next = 0;
+	curcpu->c_tlb_used = 0;
+	vmstats_inc(VMSTAT_TLB_INVALIDATE);
+
+	splx(spl);
+}
+
+/*
+ * Load a new entry into this cpu's TLB. Slots are reused in FIFO
+ * order, so the victim is always the entry loaded longest ago, and
+ * finding a slot never needs a scan. Call at splhigh.
+ */
+static
+void
+tlb_insert(uint32_t ehi, uint32_t elo)
+{
+	struct cpu *c = curcpu;
+	uint32_t oldhi, oldlo;
+	unsigned slot;
+
+	slot = c->c_tlb_next;
+	c->c_tlb_next = (slot + 1) % NUM_TLB;
+
+	if (c->c_tlb_used < NUM_TLB) {
+		c->c_tlb_used++;
+		vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+	}
+	else {
+		/* Shootdowns can leave holes behind the fill point. */
+		tlb_read(&oldhi, &oldlo, slot);
+		vmstats_inc((oldlo & TLBLO_VALID) ?
+			    VMSTAT_TLB_FAULT_REPLACE : VMSTAT_TLB_FAULT_FREE);
+	}
+	tlb_write(ehi, elo, slot);
+}
+
+static
+uint32_t
+as_newgen(void)
+{
+	uint32_t gen;
+
+	spinlock_acquire(&as_genlock);
+	gen = as_nextgen++;
+	if (as_nextgen == 0) {
+		as_nextgen = 1;
+	}
+	spinlock_release(&as_genlock);
+	return gen;
+}
+
+/*
+ * Make every cpu drop its TLB entries for AS before running it again.
+ * A cpu skips the flush in as_activate only if its TLB was last
+ * loaded for AS's current generation, so a new generation does it.
+ */
+static
+void
+as_tlb_invalidate(struct addrspace *as)
+{
+	int spl;
+
+	as->as_tlbgen = as_newgen();
+
+	spl = splhigh();
+	if (as == curproc_getas()) {
+		tlb_flush();
+		curcpu->c_tlb_asgen = as->as_tlbgen;
+	}
+	splx(spl);
+}
+
+/*
+ * Invalidate this cpu's TLB entry for VA, if it has one.
+ */
+static
+void
+tlb_invalidate(vaddr_t va)
+{
+	int i, spl;
+
+	spl = splhigh();
+	i = tlb_probe(va & PAGE_FRAME, 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	splx(spl);
+}
+
+/*
+ * Like as_tlb_invalidate, for the current address space when only the
+ * entry for VA has changed: other cpus flush everything before they
+ * run it again, but this one need only drop VA.
+ */
+static
+void
+as_tlb_invalidate_page(struct addrspace *as, vaddr_t va)
+{
+	int spl;
+
+	KASSERT(as == curproc_getas());
+
+	spl = splhigh();
+	as->as_tlbgen = as_newgen();
+	tlb_invalidate(va);
+	curcpu->c_tlb_asgen = as->as_tlbgen;
+	splx(spl);
+}
+
+/*
+ * Remove VA in AS from every cpu's TLB and wait until they have all
+ * done it. Only eviction needs this, and it holds vm_lock, so each
+ * cpu has at most one of these queued and never overflows into
+ * vm_tlbshootdown_all.
+ */
+static
+void
+tlb_shootdown_page(struct addrspace *as, vaddr_t va)
+{
+	struct tlbshootdown ts;
+	unsigned n;
+	int spl;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	ts.ts_addrspace = as;
+	ts.ts_vaddr = va;
+	ts.ts_done = vm_shootdown_sem;
+
+	/* Stay on this cpu until the others have been told. */
+	spl = splhigh();
+	tlb_invalidate(va);
+	n = ipi_tlbshootdown_broadcast(&ts);
+	splx(spl);
+
+	while (n-- > 0) {
+		P(vm_shootdown_sem);
+	}
+}
+
+void
+vm_tlbshootdown_all(void)
+{
+	tlb_flush();
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	tlb_invalidate(ts->ts_vaddr);
+	V(ts->ts_done);
+}
+
+/*
+ * Mark the page behind PTE, in AS, busy and drop vm_lock for I/O.
+ */
+static
+void
+vm_busy(struct addrspace *as, pte_t *pte)
+{
+	KASSERT(lock_do_i_hold(vm_lock));
+	KASSERT((*pte & PTE_BUSY) == 0);
+
+	*pte |= PTE_BUSY;
+	as->as_nbusy++;
+	lock_release(vm_lock);
+}
+
+/*
+ * Take vm_lock back after the I/O, and let anyone waiting for the page
+ * have it.
+ */
+static
+void
+vm_unbusy(struct addrspace *as, pte_t *pte)
+{
+	lock_acquire(vm_lock);
+	KASSERT(*pte & PTE_BUSY);
+	KASSERT(as->as_nbusy > 0);
+
+	*pte &= ~PTE_BUSY;
+	as->as_nbusy--;
+	cv_broadcast(vm_busycv, vm_lock);
+}
+
+/*
+ * Wait until no page of AS is in transit, before changing its page
+ * table wholesale. Only eviction makes pages of another process busy,
+ * and it doesn't pick new ones of AS while we hold vm_lock.
+ */
+static
+void
+as_waitbusy(struct addrspace *as)
+{
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	while (as->as_nbusy > 0) {
+		cv_wait(vm_busycv, vm_lock);
+	}
+}
+
+/*
+ * Push one user page out of memory. Dirty pages go to swap; clean
+ * ones are dropped, to be read in again from the executable or
+ * zero-filled on the next fault. If CANUNLOCK, vm_lock is dropped
+ * while the page is written.
+ *
+ * Returns ENOMEM if there is nothing left to evict. Any other error
+ * means this victim couldn't be written out; it is left in place,
+ * marked referenced so the clock passes it over next time round.
+ */
+static
+int
+vm_evict(bool canunlock)
+{
+	struct addrspace *as;
+	vaddr_t va;
+	paddr_t pa;
+	pte_t *pte;
+	unsigned slot;
+	int result;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	pa = coremap_clock(&as, &va);
+	if (pa == 0) {
+		return ENOMEM;
+	}
+
+	pte = pt_lookup(as->as_pt, va, false);
+	KASSERT(pte != NULL);
+	KASSERT((*pte & PTE_VALID) && PTE_PADDR(*pte) == pa);
+	KASSERT((*pte & PTE_BUSY) == 0);
+
+	/*
+	 * Get it out of every TLB before copying it, so the owner
+	 * can't change it behind our back. Its next fault waits for
+	 * vm_lock, or for the page if it's busy.
+	 */
+	tlb_shootdown_page(as, va);
+
+	if ((*pte & PTE_DIRTY) == 0) {
+		*pte = 0;
+		coremap_decref(pa);
+		return 0;
+	}
+
+	result = swap_alloc(&slot);
+	if (result) {
+		coremap_set_owner(pa, as, va);
+		return result;
+	}
+	/* Keep the clock off it while it's in transit. */
+	coremap_set_owner(pa, NULL, 0);
+	if (canunlock) {
+		vm_busy(as, pte);
+	}
+	result = swap_out(slot, pa);
+	if (canunlock) {
+		vm_unbusy(as, pte);
+	}
+	if (result) {
+		swap_free(slot);
+		coremap_set_owner(pa, as, va);
+		return result;
+	}
+	*pte = PTE_MKSWAP(slot);
+	coremap_decref(pa);
+	return 0;
+}
+
+paddr_t
+vm_getframes(unsigned long npages)
+{
+	paddr_t pa;
+	bool held;
+	int result, nfailed;
+
+	pa = coremap_alloc(npages);
+	if (pa != 0 || vm_lock == NULL) {
+		return pa;
+	}
+
+	/* Idle kmalloc blocks may be pinning whole pages; cheap to get. */
+	if (kmag_drain()) {
+		pa = coremap_alloc(npages);
+		if (pa != 0) {
+			return pa;
+		}
+	}
+
+	/*
+	 * We may already be inside vm_fault or the like on this thread;
+	 * if so, the caller is counting on vm_lock staying held, and the
+	 * page cache is out of bounds since it does file I/O.
+	 *
+	 * Keep the clock going past pages that fail to go to swap;
+	 * clean ones can still be dropped. Once every frame has failed
+	 * twice in a row there is no point going on.
+	 */
+	held = lock_do_i_hold(vm_lock);
+	nfailed = 0;
+	while (pa == 0 && nfailed < 2 * coremap_nframes()) {
+		if (held || !pagecache_reclaim()) {
+			if (!held) {
+				lock_acquire(vm_lock);
+			}
+			result = vm_evict(!held);
+			if (!held) {
+				lock_release(vm_lock);
+			}
+			if (result == ENOMEM) {
+				break;
+			}
+			if (result) {
+				nfailed++;
+				continue;
+			}
+		}
+		nfailed = 0;
+		pa = coremap_alloc(npages);
+	}
+	return pa;
+}
+
+void
+vm_paging_bootstrap(void)
+{
+	pagecache_bootstrap();
+	vm_lock = lock_create("vm_lock");
+	vm_busycv = cv_create("vm_busy");
+	vm_shootdown_sem = sem_create("vm_shootdown", 0);
+	if (vm_lock == NULL || vm_busycv == NULL || vm_shootdown_sem == NULL) {
+		panic("vm_paging_bootstrap: out of memory\n");
+	}
+	swap_bootstrap();
+}
+
+/*
+ * Give the page behind PTE, mapped at VA in AS, a private frame.
+ */
+static
+int
+cow_fault(struct addrspace *as, vaddr_t va, pte_t *pte)
+{
+	paddr_t oldpa, newpa;
+
+	KASSERT(*pte & PTE_COW);
+	oldpa = PTE_PADDR(*pte);
+
+	/* Everyone else already let go; the frame is ours. */
+	if (coremap_refcount(oldpa) == 1) {
+		*pte &= ~PTE_COW;
+		coremap_set_owner(oldpa, as, va);
+		return 0;
+	}
+
+	/*
+	 * Shared frames are never evicted, so oldpa stays put while we
+	 * get a frame with vm_lock dropped. The others may let go of it
+	 * meanwhile, though.
+	 */
+	lock_release(vm_lock);
+	newpa = vm_getframes(1);
+	lock_acquire(vm_lock);
+	if (newpa == 0) {
+		return ENOMEM;
+	}
+	if (coremap_refcount(oldpa) == 1) {
+		coremap_decref(newpa);
+		*pte &= ~PTE_COW;
+		coremap_set_owner(oldpa, as, va);
+		return 0;
+	}
+	memmove((void *)PADDR_TO_KVADDR(newpa),
+		(const void *)PADDR_TO_KVADDR(oldpa), PAGE_SIZE);
+	*pte = newpa | (*pte & ~(PAGE_FRAME | PTE_COW));
+	coremap_set_owner(newpa, as, va);
+	coremap_decref(oldpa);
+
+	/*
+	 * A cpu we ran on before may still map VA to oldpa, which the
+	 * other sharers keep using, and would otherwise keep that
+	 * entry through as_activate.
+	 */
+	as_tlb_invalidate_page(as, va);
+	return 0;
+}
+
+/*
+ * Fill the fresh frame PADDR for the page at VA of region RG: the part
+ * covered by the region's file image is read from its file, the rest
+ * is zeroed.
+ */
+static
+int
+load_page(struct region *rg, vaddr_t va, paddr_t paddr)
+{
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end;
+	char *kva;
+	int result;
+
+	kva = (char *)PADDR_TO_KVADDR(paddr);
+	bzero(kva, PAGE_SIZE);
+
+	start = va > rg->rg_filebase ? va : rg->rg_filebase;
+	end = va + PAGE_SIZE;
+	if (end > rg->rg_filebase + rg->rg_filesz) {
+		end = rg->rg_filebase + rg->rg_filesz;
+	}
+	if (rg->rg_filesz == 0 || start >= end) {
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+		return 0;
+	}
+
+	uio_kinit(&iov, &ku, kva + (start - va), end - start,
+		  rg->rg_offset + (start - rg->rg_filebase), UIO_READ);
+	result = VOP_READ(rg->rg_vnode, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		/* The size was checked at map time; someone truncated it. */
+		return EIO;
+	}
+
+	vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+	vmstats_inc(VMSTAT_ELF_FILE_READ);
+	return 0;
+}
+
+struct region *
+as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg;
+
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (vaddr >= rg->rg_base &&
+		    vaddr < rg->rg_base + rg->rg_npages * PAGE_SIZE) {
+			return rg;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Extend the stack down to cover the page at VA, if VA is near enough
+ * the stack pointer SP and that stays within the stack limit and
+ * doesn't run into another region (normally the heap). Returns the
+ * stack region, or NULL.
+ */
+static
+struct region *
+as_grow_stack(struct addrspace *as, vaddr_t va, vaddr_t sp)
+{
+	struct region *stack, *rg;
+
+	stack = as->as_stack;
+	if (stack == NULL || va >= stack->rg_base ||
+	    va < USERSTACK - as->as_stacklimit ||
+	    va + VM_STACKSLACK < sp) {
+		return NULL;
+	}
+	va &= PAGE_FRAME;
+
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (rg != stack && rg->rg_base < stack->rg_base &&
+		    rg->rg_base + rg->rg_npages * PAGE_SIZE > va) {
+			return NULL;
+		}
+	}
+
+	stack->rg_npages += (stack->rg_base - va) / PAGE_SIZE;
+	stack->rg_base = va;
+	return stack;
+}
+
+/*
+ * Make the page at VA resident and load it into the TLB. Called with
+ * vm_lock held, which is dropped while a frame is found and while the
+ * page is read in.
+ */
+static
+int
+vm_fault_page(struct addrspace *as, struct region *rg, int faulttype,
+	      vaddr_t va)
+{
+	pte_t *pte;
+	paddr_t paddr, spare;
+	off_t offset;
+	unsigned slot;
+	bool writeable, reload, fromdisk;
+	uint32_t ehi, elo;
+	int i, spl, result;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	/* Text stays writable until load_elf has finished with it. */
+	writeable = (rg->rg_flags & RG_WRITE) || !as->loaded_elf;
+	if (faulttype != VM_FAULT_READ && !writeable) {
+		return EFAULT;
+	}
+
+	spare = 0;
+ again:
+	pte = pt_lookup(as->as_pt, va, true);
+	if (pte == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+	if (*pte & PTE_BUSY) {
+		/* Being written to swap; wait for it. */
+		cv_wait(vm_busycv, vm_lock);
+		goto again;
+	}
+	if ((*pte & PTE_VALID) == 0 && (rg->rg_flags & RG_SHARED) == 0 &&
+	    spare == 0) {
+		/* It needs a frame; things may change while we get one. */
+		lock_release(vm_lock);
+		spare = vm_getframes(1);
+		lock_acquire(vm_lock);
+		if (spare == 0) {
+			return ENOMEM;
+		}
+		goto again;
+	}
+
+	reload = false;
+	if (*pte & PTE_SWAPPED) {
+		paddr = spare;
+		spare = 0;
+		slot = PTE_SWAPSLOT(*pte);
+		vm_busy(as, pte);
+		result = swap_in(slot, paddr);
+		vm_unbusy(as, pte);
+		if (result) {
+			coremap_decref(paddr);
+			return result;
+		}
+		swap_free(slot);
+		/* With the slot gone, eviction must write it out again. */
+		*pte = paddr | PTE_VALID | PTE_DIRTY;
+		coremap_set_owner(paddr, as, va);
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+	}
+	else if ((*pte & PTE_VALID) == 0 && (rg->rg_flags & RG_SHARED)) {
+		/*
+		 * Map the cached copy; the cache keeps its own reference.
+		 * It may have to be read in, so let go of vm_lock.
+		 */
+		offset = rg->rg_offset + (va - rg->rg_base);
+		lock_release(vm_lock);
+		result = pagecache_get(rg->rg_vnode, offset, &paddr, &fromdisk);
+		lock_acquire(vm_lock);
+		if (result) {
+			return result;
+		}
+		pte = pt_lookup(as->as_pt, va, true);
+		if (pte == NULL || (*pte & PTE_VALID)) {
+			/* Lost the page table, or a race to map it. */
+			coremap_decref(paddr);
+			if (pte == NULL) {
+				return ENOMEM;
+			}
+			goto again;
+		}
+		*pte = paddr | PTE_VALID | PTE_SHARED;
+		if (fromdisk) {
+			vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+			vmstats_inc(VMSTAT_ELF_FILE_READ);
+		}
+		else {
+			/* Someone else already brought it in. */
+			reload = true;
+		}
+	}
+	else if ((*pte & PTE_VALID) == 0) {
+		/* First touch: read the page in or zero-fill it. */
+		paddr = spare;
+		spare = 0;
+		vm_busy(as, pte);
+		result = load_page(rg, va, paddr);
+		vm_unbusy(as, pte);
+		if (result) {
+			coremap_decref(paddr);
+			return result;
+		}
+		*pte = paddr | PTE_VALID;
+		coremap_set_owner(paddr, as, va);
+	}
+	else {
+		reload = true;
+		if ((*pte & PTE_SHARED) == 0 &&
+		    coremap_refcount(PTE_PADDR(*pte)) == 1) {
+			/* Possibly left to us by a COW partner; claim it. */
+			coremap_set_owner(PTE_PADDR(*pte), as, va);
+		}
+	}
+	if (spare != 0) {
+		/* Somebody brought it in after all. */
+		coremap_decref(spare);
+	}
+
+	if (faulttype != VM_FAULT_READ) {
+		if (*pte & PTE_COW) {
+			result = cow_fault(as, va, pte);
+			if (result) {
+				return result;
+			}
+		}
+		if ((*pte & (PTE_SHARED | PTE_DIRTY)) == PTE_SHARED) {
+			pagecache_markdirty(rg->rg_vnode,
+					    rg->rg_offset + (va - rg->rg_base));
+		}
+		*pte |= PTE_DIRTY;
+	}
+	paddr = PTE_PADDR(*pte);
+
+	/*
+	 * TLB hits never get here, so a TLB load, reload or upgrade is
+	 * the only sign of use the clock gets.
+	 */
+	coremap_touch(paddr);
+
+	/*
+	 * Only let the TLB take writes once the page is private and
+	 * known dirty; until then the first write comes back here as
+	 * a readonly fault.
+	 */
+	ehi = va;
+	elo = paddr | TLBLO_VALID;
+	if (writeable && (*pte & (PTE_DIRTY | PTE_COW)) == PTE_DIRTY) {
+		elo |= TLBLO_DIRTY;
+	}
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	/*
+	 * A readonly fault means an entry for this page is already
+	 * loaded; upgrading it in place is not a TLB miss.
+	 */
+	i = tlb_probe(ehi, 0);
+	if (i >= 0) {
+		tlb_write(ehi, elo, i);
+		splx(spl);
+		return 0;
+	}
+
+	vmstats_inc(VMSTAT_TLB_FAULT);
+	if (reload) {
+		vmstats_inc(VMSTAT_TLB_RELOAD);
+	}
+	DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", va, paddr);
+	tlb_insert(ehi, elo);
+	splx(spl);
+	return 0;
+
+ fail:
+	if (spare != 0) {
+		coremap_decref(spare);
+	}
+	return result;
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	struct region *rg;
+	vaddr_t rawaddress;
+	int result;
+
+	rawaddress = faultaddress;
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "vm: fault: 0x%x\n", faultaddress);
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = curproc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	rg = as_find_region(as, faultaddress);
+	if (rg == NULL) {
+		/*
+		 * For a fault in user mode, trap.c has just recorded
+		 * the stack pointer; for one in copyin or copyout, it's
+		 * the one the system call came in with.
+		 */
+		rg = as_grow_stack(as, rawaddress, curthread->t_usersp);
+		if (rg == NULL) {
+			return EFAULT;
+		}
+	}
+
+	lock_acquire(vm_lock);
+	result = vm_fault_page(as, rg, faulttype, faultaddress);
+	lock_release(vm_lock);
+	return result;
+}
+
+struct addrspace *
+as_create(void)
+{
+	struct addrspace *as = kmalloc(sizeof(struct addrspace));
+	if (as==NULL) {
+		return NULL;
+	}
+
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	as->as_regions = NULL;
+	as->as_heap = NULL;
+	as->as_heapbrk = 0;
+	as->as_stack = NULL;
+	as->as_stacklimit = VM_STACKLIMIT;
+	as->as_tlbgen = as_newgen();
+	as->as_nbusy = 0;
+	as->loaded_elf = 0;
+
+	return as;
+}
+
+void
+as_destroy(struct addrspace *as)
+{
+	struct region *rg;
+
+	lock_acquire(vm_lock);
+	as_waitbusy(as);
+	pt_destroy(as->as_pt);
+	lock_release(vm_lock);
+	/* Write back what we wrote, now that nothing can add to it. */
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (rg->rg_flags & RG_SHARED) {
+			pagecache_flush(rg->rg_vnode, rg->rg_offset,
+					rg->rg_offset +
+					rg->rg_npages * PAGE_SIZE);
+		}
+	}
+	while ((rg = as->as_regions) != NULL) {
+		as->as_regions = rg->rg_next;
+		if (rg->rg_vnode != NULL) {
+			VOP_DECREF(rg->rg_vnode);
+		}
+		kfree(rg);
+	}
+	kfree(as);
+}
+
+void
+as_activate(void)
+{
+	struct addrspace *as;
+	int spl;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		/* Kernel threads don't have an address spaces to activate */
+		return;
+	}
+
+	/* Switching back to the same address space keeps its entries. */
+	spl = splhigh();
+	if (curcpu->c_tlb_asgen != as->as_tlbgen) {
+		tlb_flush();
+		curcpu->c_tlb_asgen = as->as_tlbgen;
+	}
+	splx(spl);
+}
+
+void
+as_deactivate(void)
+{
+	int spl;
+
+	/* Whatever runs next must not trust what is in the TLB. */
+	spl = splhigh();
+	curcpu->c_tlb_asgen = 0;
+	splx(spl);
+}
+
+int
+as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+		 int readable, int writeable, int executable)
+{
+	struct region *rg;
+
+	/* Align the region. First, the base... */
+	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	/* ...and now the length. */
+	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	if (vaddr + sz > USERSPACETOP || vaddr + sz < vaddr) {
+		return EFAULT;
+	}
+
+	rg = kmalloc(sizeof(struct region));
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+	rg->rg_base = vaddr;
+	rg->rg_npages = sz / PAGE_SIZE;
+	rg->rg_flags = (readable ? RG_READ : 0) |
+		(writeable ? RG_WRITE : 0) |
+		(executable ? RG_EXEC : 0);
+	rg->rg_filebase = vaddr;
+	rg->rg_offset = 0;
+	rg->rg_filesz = 0;
+	rg->rg_vnode = NULL;
+
+	rg->rg_next = as->as_regions;
+	as->as_regions = rg;
+	return 0;
+}
+
+int
+as_map_segment(struct addrspace *as, struct vnode *v, off_t offset,
+	       vaddr_t vaddr, size_t filesz)
+{
+	struct region *rg;
+	struct stat st;
+	int result;
+
+	rg = as_find_region(as, vaddr);
+	if (rg == NULL ||
+	    vaddr + filesz > rg->rg_base + rg->rg_npages * PAGE_SIZE) {
+		return ENOEXEC;
+	}
+
+	/* Catch truncated executables now rather than at fault time. */
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+	if (offset < 0 || offset + (off_t)filesz > st.st_size) {
+		kprintf("ELF: segment past end of file - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	KASSERT(rg->rg_vnode == NULL);
+	VOP_INCREF(v);
+	rg->rg_vnode = v;
+	rg->rg_filebase = vaddr;
+	rg->rg_offset = offset;
+	rg->rg_filesz = filesz;
+	return 0;
+}
+
+int
+as_prepare_load(struct addrspace *as)
+{
+	/* Segments are read in by vm_fault, not by load_elf. */
+	(void)as;
+	return 0;
+}
+
+int
+as_complete_load(struct addrspace *as)
+{
+	struct region *rg;
+	vaddr_t top;
+	int result;
+
+	/* The heap starts, empty, on the page after the last segment. */
+	top = 0;
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (rg->rg_base + rg->rg_npages * PAGE_SIZE > top) {
+			top = rg->rg_base + rg->rg_npages * PAGE_SIZE;
+		}
+	}
+	result = as_define_region(as, top, 0, 1, 1, 0);
+	if (result) {
+		return result;
+	}
+	as->as_heap = as->as_regions;
+	as->as_heapbrk = top;
+
+	/* Text becomes read-only; drop any writable mappings of it. */
+	as->loaded_elf = 1;
+	as_tlb_invalidate(as);
+	return 0;
+}
+
+int
+as_define_stack(struct addrspace *as, vaddr_t *stackptr)
+{
+	int result;
+
+	result = as_define_region(as, USERSTACK - VM_STACKPAGES * PAGE_SIZE,
+				  VM_STACKPAGES * PAGE_SIZE, 1, 1, 0);
+	if (result) {
+		return result;
+	}
+	as->as_stack = as->as_regions;
+
+	*stackptr = USERSTACK;
+	return 0;
+}
+
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbrk)
+{
+	struct region *heap, *rg;
+	vaddr_t brk, newbrk, top, newtop, va;
+
+	heap = as->as_heap;
+	if (heap == NULL) {
+		return ENOMEM;
+	}
+
+	brk = as->as_heapbrk;
+	newbrk = brk + amount;
+	if (amount < 0 && (newbrk > brk || newbrk < heap->rg_base)) {
+		return EINVAL;
+	}
+	if (amount > 0 && (newbrk < brk || newbrk > USERSPACETOP)) {
+		return ENOMEM;
+	}
+
+	top = heap->rg_base + heap->rg_npages * PAGE_SIZE;
+	newtop = ROUNDUP(newbrk, PAGE_SIZE);
+
+	if (newtop > top) {
+		/* Leave the stack room to grow, and don't hit anything else. */
+		if (as->as_stack != NULL &&
+		    newtop > USERSTACK - as->as_stacklimit) {
+			return ENOMEM;
+		}
+		for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+			if (rg != heap && rg->rg_base < newtop &&
+			    rg->rg_base + rg->rg_npages * PAGE_SIZE > top) {
+				return ENOMEM;
+			}
+		}
+	}
+	else if (newtop < top) {
+		lock_acquire(vm_lock);
+		as_waitbusy(as);
+		for (va = newtop; va < top; va += PAGE_SIZE) {
+			pt_clear(as->as_pt, va);
+		}
+		as_tlb_invalidate(as);
+		lock_release(vm_lock);
+	}
+
+	/* Pages in the new part are zero-filled by vm_fault. */
+	heap->rg_npages = (newtop - heap->rg_base) / PAGE_SIZE;
+	as->as_heapbrk = newbrk;
+	*oldbrk = brk;
+	return 0;
+}
+
+/*
+ * Find room for NPAGES pages as high as possible below the stack's
+ * reserved range, reusing holes left by munmap. Returns 0 if there
+ * is none.
+ */
+static
+vaddr_t
+as_find_hole(struct addrspace *as, size_t npages)
+{
+	struct region *rg;
+	vaddr_t base, top;
+	size_t sz;
+
+	sz = npages * PAGE_SIZE;
+	top = USERSTACK - as->as_stacklimit;
+	while (top >= sz) {
+		base = top - sz;
+		for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+			if (rg->rg_base < top &&
+			    rg->rg_base + rg->rg_npages * PAGE_SIZE > base) {
+				break;
+			}
+		}
+		if (rg == NULL) {
+			return base;
+		}
+		/* Try again just below whatever is in the way. */
+		top = rg->rg_base;
+	}
+	return 0;
+}
+
+int
+as_mmap(struct addrspace *as, struct vnode *vn, size_t len, int prot,
+	int flags, off_t offset, vaddr_t *addr)
+{
+	struct region *rg;
+	struct stat st;
+	size_t npages;
+	vaddr_t base;
+	int result;
+
+	if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	if (flags != MAP_SHARED && flags != MAP_PRIVATE) {
+		return EINVAL;
+	}
+	if (len > USERSPACETOP) {
+		return ENOMEM;
+	}
+	npages = ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE;
+
+	result = VOP_MMAP(vn);
+	if (result) {
+		/* Devices and the like can't be mapped. */
+		return result == EUNIMP ? ENODEV : result;
+	}
+	result = VOP_STAT(vn, &st);
+	if (result) {
+		return result;
+	}
+
+	base = as_find_hole(as, npages);
+	if (base == 0) {
+		return ENOMEM;
+	}
+
+	rg = kmalloc(sizeof(struct region));
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+	rg->rg_base = base;
+	rg->rg_npages = npages;
+	rg->rg_flags = RG_MAPPED |
+		((prot & PROT_READ) ? RG_READ : 0) |
+		((prot & PROT_WRITE) ? RG_WRITE : 0) |
+		((prot & PROT_EXEC) ? RG_EXEC : 0);
+	rg->rg_filebase = base;
+	rg->rg_offset = offset;
+
+	/* Private pages past the end of the file are zero-filled. */
+	rg->rg_filesz = 0;
+	if (offset < st.st_size) {
+		rg->rg_filesz = st.st_size - offset < (off_t)len ?
+			st.st_size - offset : len;
+	}
+	if (flags == MAP_SHARED) {
+		rg->rg_flags |= RG_SHARED;
+	}
+
+	VOP_INCREF(vn);
+	rg->rg_vnode = vn;
+
+	rg->rg_next = as->as_regions;
+	as->as_regions = rg;
+	*addr = base;
+	return 0;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t addr, size_t len)
+{
+	struct region *rg, **rgp;
+	vaddr_t va;
+	size_t npages;
+	int result;
+
+	npages = ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE;
+	for (rgp = &as->as_regions; (rg = *rgp) != NULL; rgp = &rg->rg_next) {
+		if (rg->rg_base == addr) {
+			break;
+		}
+	}
+	/* Only whole mappings can be removed. */
+	if (rg == NULL || (rg->rg_flags & RG_MAPPED) == 0 ||
+	    rg->rg_npages != npages) {
+		return EINVAL;
+	}
+
+	result = 0;
+	lock_acquire(vm_lock);
+	as_waitbusy(as);
+	for (va = rg->rg_base; va < rg->rg_base + npages * PAGE_SIZE;
+	     va += PAGE_SIZE) {
+		pt_clear(as->as_pt, va);
+	}
+	as_tlb_invalidate(as);
+	lock_release(vm_lock);
+	if (rg->rg_flags & RG_SHARED) {
+		result = pagecache_flush(rg->rg_vnode, rg->rg_offset,
+					 rg->rg_offset + npages * PAGE_SIZE);
+	}
+
+	*rgp = rg->rg_next;
+	VOP_DECREF(rg->rg_vnode);
+	kfree(rg);
+	return result;
+}
+
+int
+vm_fsync(struct vnode *vn)
+{
+	struct stat st;
+	int result;
+
+	result = VOP_STAT(vn, &st);
+	if (result) {
+		return result;
+	}
+
+	return pagecache_flush(vn, 0, ROUNDUP(st.st_size, PAGE_SIZE));
+}
+
+int
+vm_prewrite(struct vnode *vn, off_t start, off_t end)
+{
+	return pagecache_prewrite(vn, start, end);
+}
+
+void
+vm_postwrite(struct vnode *vn, off_t start, off_t end)
+{
+	pagecache_postwrite(vn, start, end);
+}
+
+int
+as_copy(struct addrspace *old, struct addrspace **ret)
+{
+	struct addrspace *new;
+	struct region *rg, *newrg, **tail;
+	int result;
+
+	new = as_create();
+	if (new==NULL) {
+		return ENOMEM;
+	}
+	new->loaded_elf = old->loaded_elf;
+
+	/* Keep the regions in the same order as the parent. */
+	tail = &new->as_regions;
+	for (rg = old->as_regions; rg != NULL; rg = rg->rg_next) {
+		newrg = kmalloc(sizeof(struct region));
+		if (newrg == NULL) {
+			as_destroy(new);
+			return ENOMEM;
+		}
+		*newrg = *rg;
+		newrg->rg_next = NULL;
+		if (newrg->rg_vnode != NULL) {
+			VOP_INCREF(newrg->rg_vnode);
+		}
+		*tail = newrg;
+		tail = &newrg->rg_next;
+		if (rg == old->as_heap) {
+			new->as_heap = newrg;
+		}
+		if (rg == old->as_stack) {
+			new->as_stack = newrg;
+		}
+	}
+	new->as_heapbrk = old->as_heapbrk;
+	new->as_stacklimit = old->as_stacklimit;
+
+	lock_acquire(vm_lock);
+	as_waitbusy(old);
+	result = pt_copy(old->as_pt, new->as_pt);
+	/*
+	 * Even on failure some of old's pages may have become COW;
+	 * its writable TLB entries for them must go.
+	 */
+	as_tlb_invalidate(old);
+	lock_release(vm_lock);
+	if (result) {
+		as_destroy(new);
+		return result;
+	}
+
+	*ret = new;
+	return 0;
+}
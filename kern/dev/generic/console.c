@@ -46,6 +46,12 @@
  * and (2) if the system crashes before we find a console, no output
  * at all may appear.
  *
+ * Output is buffered. Characters printed with interrupts on go into
+ * a ring of CONSOLE_OUTPUT_BUFFER_SIZE, and the printer goes on its
+ * way; the device's write-done interrupt sends the next one. Only a
+ * printer that finds the ring full has to wait. Printing by polling
+ * first sends whatever is in the ring, so output stays in order.
+ *
  * Note that we have no input buffering; characters typed too rapidly
  * will be lost.
  */
@@ -57,6 +63,7 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <generic/console.h>
 #include <vfs.h>
 #include <device.h>
@@ -74,6 +81,12 @@ static struct con_softc *the_console = NULL;
 static struct lock *con_userlock_read = NULL;
 static struct lock *con_userlock_write = NULL;
 
+/*
+ * User writes are copied in here, a ring's worth at a time, before
+ * going into the output ring. Protected by con_userlock_write.
+ */
+static char con_userbuf[CONSOLE_OUTPUT_BUFFER_SIZE];
+
 //////////////////////////////////////////////////
 
 /*
@@ -111,6 +124,33 @@ flush_delay_buf(void)
 
 //////////////////////////////////////////////////
 
+/*
+ * Send everything in the output ring by polling, so anything printed
+ * by polling comes out after it. If this CPU is the one holding the
+ * ring (a panic while queueing output), leave it alone.
+ */
+static
+void
+flush_polled(struct con_softc *cs)
+{
+	if (cs->cs_outcount == 0 || spinlock_do_i_hold(&cs->cs_outlock)) {
+		return;
+	}
+
+	spinlock_acquire(&cs->cs_outlock);
+	while (cs->cs_outcount > 0) {
+		cs->cs_sendpolled(cs->cs_devdata,
+				  cs->cs_outbuf[cs->cs_outhead]);
+		cs->cs_outhead = (cs->cs_outhead + 1) %
+			CONSOLE_OUTPUT_BUFFER_SIZE;
+		cs->cs_outcount--;
+	}
+	if (cs->cs_outwaiters > 0) {
+		wchan_wakeall(cs->cs_outwchan);
+	}
+	spinlock_release(&cs->cs_outlock);
+}
+
 /*
  * Print a character, using polling instead of interrupts to wait for
  * I/O completion.
@@ -119,6 +159,7 @@ static
 void
 putch_polled(struct con_softc *cs, int ch)
 {
+	flush_polled(cs);
 	cs->cs_sendpolled(cs->cs_devdata, ch);
 }
 
@@ -143,16 +184,69 @@ putch_complete_polled(struct con_softc *cs)
 //////////////////////////////////////////////////
 
 /*
- * Print a character, using interrupts to wait for I/O completion.
+ * Hand the next character in the output ring to the device, or note
+ * that it's idle if there isn't one.
  */
 static
 void
-putch_intr(struct con_softc *cs, int ch)
+con_sendnext(struct con_softc *cs)
 {
-	P(cs->cs_wsem);
+	int ch;
+
+	KASSERT(spinlock_do_i_hold(&cs->cs_outlock));
+
+	if (cs->cs_outcount == 0) {
+		cs->cs_outbusy = false;
+		return;
+	}
+	ch = cs->cs_outbuf[cs->cs_outhead];
+	cs->cs_outhead = (cs->cs_outhead + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+	cs->cs_outcount--;
+	cs->cs_outbusy = true;
 	cs->cs_send(cs->cs_devdata, ch);
 }
 
+/*
+ * Print LEN characters, using interrupts to wait for I/O completion.
+ * They go into the output ring, and we wait only if it fills up. If
+ * CRLF, each newline goes out as CR-LF.
+ */
+static
+void
+putchars_intr(struct con_softc *cs, const char *buf, size_t len, bool crlf)
+{
+	unsigned tail, need;
+	size_t i;
+
+	spinlock_acquire(&cs->cs_outlock);
+	for (i=0; i<len; i++) {
+		need = (crlf && buf[i] == '\n') ? 2 : 1;
+		while (CONSOLE_OUTPUT_BUFFER_SIZE - cs->cs_outcount < need) {
+			/* Full, so the device is busy emptying it. */
+			KASSERT(cs->cs_outbusy);
+			cs->cs_outwaiters++;
+			wchan_lock(cs->cs_outwchan);
+			spinlock_release(&cs->cs_outlock);
+			wchan_sleep(cs->cs_outwchan);
+			spinlock_acquire(&cs->cs_outlock);
+			cs->cs_outwaiters--;
+		}
+		tail = (cs->cs_outhead + cs->cs_outcount) %
+			CONSOLE_OUTPUT_BUFFER_SIZE;
+		if (need == 2) {
+			cs->cs_outbuf[tail] = '\r';
+			tail = (tail + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+			cs->cs_outcount++;
+		}
+		cs->cs_outbuf[tail] = buf[i];
+		cs->cs_outcount++;
+		if (!cs->cs_outbusy) {
+			con_sendnext(cs);
+		}
+	}
+	spinlock_release(&cs->cs_outlock);
+}
+
 /*
  * Read a character, using interrupts to wait for I/O completion.
  */
@@ -198,13 +292,22 @@ con_input(void *vcs, int ch)
 
 /*
  * Called from underlying device when a write-done interrupt occurs.
+ * Send the next character, and once half the ring is free, wake up
+ * anyone waiting for room. (Waking them one character at a time
+ * would mostly wake them to go back to sleep.)
  */
 void
 con_start(void *vcs)
 {
 	struct con_softc *cs = vcs;
 
-	V(cs->cs_wsem);
+	spinlock_acquire(&cs->cs_outlock);
+	con_sendnext(cs);
+	if (cs->cs_outwaiters > 0 &&
+	    cs->cs_outcount <= CONSOLE_OUTPUT_BUFFER_SIZE / 2) {
+		wchan_wakeall(cs->cs_outwchan);
+	}
+	spinlock_release(&cs->cs_outlock);
 }
 
 //////////////////////////////////////////////////
@@ -219,17 +322,30 @@ con_start(void *vcs)
 
 void
 putch(int ch)
+{
+	char c = ch;
+
+	putchars(&c, 1);
+}
+
+void
+putchars(const char *buf, size_t len)
 {
 	struct con_softc *cs = the_console;
+	size_t i;
 
 	if (cs==NULL) {
-		putch_delayed(ch);
+		for (i=0; i<len; i++) {
+			putch_delayed(buf[i]);
+		}
 	}
 	else if (curthread->t_in_interrupt || curthread->t_iplhigh_count > 0) {
-		putch_polled(cs, ch);
+		for (i=0; i<len; i++) {
+			putch_polled(cs, buf[i]);
+		}
 	}
 	else {
-		putch_intr(cs, ch);
+		putchars_intr(cs, buf, len, false);
 	}
 }
 
@@ -298,15 +414,18 @@ con_close(struct device *dev)
 	return 0;
 }
 
+/*
+ * Writes are copied in a ring's worth at a time and queued whole.
+ */
 static
 int
 con_io(struct device *dev, struct uio *uio)
 {
 	int result;
 	char ch;
+	size_t len;
 	struct lock *lk;
-
-	(void)dev;  // unused
+	struct con_softc *cs = dev->d_data;
 
 	if (uio->uio_rw==UIO_READ) {
 		lk = con_userlock_read;
@@ -334,15 +453,16 @@ con_io(struct device *dev, struct uio *uio)
 			}
 		}
 		else {
-			result = uiomove(&ch, 1, uio);
+			len = uio->uio_resid;
+			if (len > sizeof(con_userbuf)) {
+				len = sizeof(con_userbuf);
+			}
+			result = uiomove(con_userbuf, len, uio);
 			if (result) {
 				lock_release(lk);
 				return result;
 			}
-			if (ch=='\n') {
-				putch('\r');
-			}
-			putch(ch);
+			putchars_intr(cs, con_userbuf, len, true);
 		}
 	}
 	lock_release(lk);
@@ -398,7 +518,8 @@ attach_console_to_vfs(struct con_softc *cs)
 int
 config_con(struct con_softc *cs, int unit)
 {
-	struct semaphore *rsem, *wsem;
+	struct semaphore *rsem;
+	struct wchan *outwchan;
 	struct lock *rlk, *wlk;
 
 	/*
@@ -418,29 +539,34 @@ config_con(struct con_softc *cs, int unit)
 	if (rsem == NULL) {
 		return ENOMEM;
 	}
-	wsem = sem_create("console write", 1);
-	if (wsem == NULL) {
+	outwchan = wchan_create("console write");
+	if (outwchan == NULL) {
 		sem_destroy(rsem);
 		return ENOMEM;
 	}
 	rlk = lock_create("console-lock-read");
 	if (rlk == NULL) {
 		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(outwchan);
 		return ENOMEM;
 	}
 	wlk = lock_create("console-lock-write");
 	if (wlk == NULL) {
 		lock_destroy(rlk);
 		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(outwchan);
 		return ENOMEM;
 	}
 
 	cs->cs_rsem = rsem; 
-	cs->cs_wsem = wsem; 
 	cs->cs_gotchars_head = 0;
 	cs->cs_gotchars_tail = 0;
+	spinlock_init(&cs->cs_outlock);
+	cs->cs_outwchan = outwchan;
+	cs->cs_outwaiters = 0;
+	cs->cs_outbusy = false;
+	cs->cs_outhead = 0;
+	cs->cs_outcount = 0;
 
 	the_console = cs;
 	con_userlock_read = rlk;
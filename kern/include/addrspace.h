@@ -36,8 +36,12 @@
 
 
 #include <vm.h>
+#include "opt-A3.h"
 
 struct vnode;
+#if OPT_A3
+struct pagetable;
+#endif
 
 
 /* 
@@ -47,6 +51,83 @@ struct vnode;
  * You write this.
  */
 
+#if OPT_A3
+
+/* Region permission bits (rg_flags) */
+#define RG_READ    0x1
+#define RG_WRITE   0x2
+#define RG_EXEC    0x4
+#define RG_MAPPED  0x10	/* created by mmap */
+#define RG_SHARED  0x20	/* pages come from the page cache */
+
+/*
+ * A contiguous range of valid user addresses. Pages inside a region
+ * are materialized by vm_fault on first touch.
+ *
+ * A region backed by a file (an ELF segment or a private mapping)
+ * also records where its file image lives: the rg_filesz bytes
+ * starting at user address rg_filebase come from rg_vnode at
+ * rg_offset. The rest of the region is zero-filled. A shared mapping
+ * instead maps the page cache's copy of rg_vnode, starting at
+ * rg_offset, for the whole region.
+ */
+struct region {
+  vaddr_t rg_base;
+  size_t rg_npages;
+  int rg_flags;
+  vaddr_t rg_filebase;
+  off_t rg_offset;
+  size_t rg_filesz;
+  struct vnode *rg_vnode;	/* referenced; NULL for anonymous memory */
+  struct region *rg_next;
+};
+
+struct addrspace {
+  struct pagetable *as_pt;
+  struct region *as_regions;
+  struct region *as_heap;	/* grown and shrunk by sbrk */
+  vaddr_t as_heapbrk;		/* current break, within or at the end of as_heap */
+  struct region *as_stack;	/* grows down on fault */
+  size_t as_stacklimit;		/* how far below USERSTACK it may grow */
+  uint32_t as_tlbgen;		/* changes when cached TLB entries go stale */
+  unsigned as_nbusy;		/* pages with PTE_BUSY set; under vm_lock */
+  int loaded_elf;
+};
+
+/* Find the region containing VADDR, or NULL. */
+struct region *as_find_region(struct addrspace *as, vaddr_t vaddr);
+
+/*
+ * Back the region containing VADDR with FILESZ bytes of V starting at
+ * OFFSET, to be read in page by page as they are faulted on. Takes a
+ * reference to V, which is dropped by as_destroy.
+ */
+int as_map_segment(struct addrspace *as, struct vnode *v, off_t offset,
+                   vaddr_t vaddr, size_t filesz);
+
+/*
+ * Move the heap break by AMOUNT bytes and return the old break in
+ * OLDBRK. Growing only reserves address space; shrinking frees the
+ * pages given back.
+ */
+int as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbrk);
+
+/*
+ * Map LEN bytes of VN starting at OFFSET somewhere below the stack's
+ * reserved range and return the address in ADDR. PROT and FLAGS are
+ * as for mmap(2). Takes a reference to VN.
+ */
+int as_mmap(struct addrspace *as, struct vnode *vn, size_t len, int prot,
+            int flags, off_t offset, vaddr_t *addr);
+
+/*
+ * Remove the mapping at ADDR, which must be exactly LEN bytes (rounded
+ * up to a page) long, writing back its dirty shared pages.
+ */
+int as_munmap(struct addrspace *as, vaddr_t addr, size_t len);
+
+#else
+
 struct addrspace {
   vaddr_t as_vbase1;
   paddr_t as_pbase1;
@@ -58,6 +139,8 @@ struct addrspace {
   int loaded_elf;
 };
 
+#endif /* OPT_A3 */
+
 /*
  * Functions in addrspace.c:
  *
@@ -0,0 +1,95 @@
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/*
+ * Physical page frame allocator.
+ *
+ * Frames are managed by a binary buddy allocator: every free block
+ * is a power-of-two run of frames, naturally aligned relative to the
+ * first managed frame, and sits on the free list for its order.
+ * Allocation splits the smallest block that is big enough; freeing
+ * merges a block with its buddy for as long as the buddy is free.
+ * Both are O(CM_MAXORDER).
+ *
+ * Before coremap_bootstrap runs, frames come from ram_stealmem and
+ * are never given back.
+ *
+ * Single frames (thread stacks, kmalloc subpage refills) are served
+ * from a small per-cpu magazine first. A magazine is refilled from,
+ * and drained back to, the buddy lists PCACHE_BATCH frames at a time
+ * so most single-page traffic never touches coremap_lock.
+ */
+
+#include <spinlock.h>
+#include <vm.h>
+
+struct addrspace;
+
+/* Largest block the allocator tracks is 2^CM_MAXORDER frames. */
+#define CM_MAXORDER 10
+
+/* Per-cpu magazine capacity, and how many frames move per refill/drain. */
+#define PCACHE_SIZE  16
+#define PCACHE_BATCH 8
+
+struct pcache {
+	struct spinlock pc_lock;
+	unsigned pc_count;
+	paddr_t pc_frames[PCACHE_SIZE];
+	unsigned pc_hits;		/* allocations served from the magazine */
+	unsigned pc_misses;		/* allocations that went to the buddy lists */
+	unsigned pc_frees;		/* frees absorbed by the magazine */
+	unsigned pc_drains;		/* batches pushed back to the buddy lists */
+};
+
+/* Set up the magazine for cpu number CPUNUM. Called from cpu_create. */
+void pcache_init(struct pcache *pc, unsigned cpunum);
+
+/* Set up the coremap. Takes ownership of all remaining RAM. */
+void coremap_bootstrap(void);
+
+/* True once coremap_bootstrap has run. */
+bool coremap_ready(void);
+
+/*
+ * Allocate NPAGES physically contiguous frames, rounded up to a
+ * power of two. Returns 0 if no block large enough is free.
+ */
+paddr_t coremap_alloc(unsigned long npages);
+
+/*
+ * Free a block returned by coremap_alloc. Frames that were stolen
+ * before the coremap existed are silently ignored.
+ */
+void coremap_free(paddr_t pa);
+
+/*
+ * Reference counts for frames shared copy-on-write between address
+ * spaces. coremap_alloc hands out frames with a count of one;
+ * coremap_decref frees the frame when the count drops to zero.
+ */
+void coremap_incref(paddr_t pa);
+void coremap_decref(paddr_t pa);
+unsigned coremap_refcount(paddr_t pa);
+
+/*
+ * Reverse map for pageable user frames, used to choose pages to swap
+ * out. A frame with an owner is mapped by exactly one page table, at
+ * VA in address space AS; sharing it (coremap_incref) or freeing it
+ * forgets the owner. The VM serializes calls to these with its own
+ * lock.
+ *
+ * coremap_touch marks the page as recently used. coremap_clock picks
+ * an owned page that has not been used since the clock last passed,
+ * or returns 0 if there are none. coremap_nframes is the number of
+ * frames the clock sweeps over.
+ */
+void coremap_set_owner(paddr_t pa, struct addrspace *as, vaddr_t va);
+void coremap_touch(paddr_t pa);
+paddr_t coremap_clock(struct addrspace **as, vaddr_t *va);
+int coremap_nframes(void);
+
+/* Print free-list occupancy and per-cpu magazine hit rates. */
+void coremap_printstats(void);
+
+#endif /* _COREMAP_H_ */
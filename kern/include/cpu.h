@@ -34,8 +34,19 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include <kmalloc.h>	/* for struct kmag */
+#include "opt-A3.h"
+#if OPT_A3
+#include <coremap.h>	/* for struct pcache */
+#endif
 
 
+/*
+ * Number of scheduling priorities. Each cpu has one run queue per
+ * priority; 0 is the most urgent. See schedule() in thread.c.
+ */
+#define SCHED_NPRIO 4
+
 /*
  * Per-cpu structure
  *
@@ -60,13 +71,18 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_steals;		/* Threads taken from other cpus */
+	unsigned c_stealmisses;		/* Looked for one and found none */
+	struct thread *c_handoff;	/* Must move elsewhere; see thread.c */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[SCHED_NPRIO]; /* Run queues, by priority */
+	unsigned c_runcount;		/* Threads on all of c_runqueue */
+	unsigned c_migrations;		/* Threads sent here by affinity */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -87,6 +103,30 @@ struct cpu {
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
 	struct spinlock c_ipi_lock;
+
+	/*
+	 * Magazines of free kmalloc blocks, one stack per block size.
+	 */
+	struct kmag c_kmag;
+
+#if OPT_A3
+	/*
+	 * Magazine of free page frames. Has its own lock so other
+	 * cpus can drain it when memory gets tight.
+	 */
+	struct pcache c_pcache;
+
+	/*
+	 * TLB bookkeeping for vm.c. The TLB only ever holds entries
+	 * for the address space whose generation is c_tlb_asgen, so
+	 * switching back to it needs no flush. Slots are handed out
+	 * in FIFO order from c_tlb_next; the first c_tlb_used of them
+	 * have been filled since the last flush.
+	 */
+	uint32_t c_tlb_asgen;
+	unsigned c_tlb_next;
+	unsigned c_tlb_used;
+#endif
 };
 
 #define TLBSHOOTDOWN_ALL  (-1)
@@ -152,6 +192,8 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_broadcast sends it to all CPUs except the current
+ * one, and returns how many that was.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -166,6 +208,7 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
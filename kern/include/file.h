@@ -0,0 +1,87 @@
+#ifndef _FILE_H_
+#define _FILE_H_
+
+/*
+ * Open files and per-process file tables.
+ *
+ * An open file is what one call to open() makes: a vnode, the access
+ * mode, and a seek position. Descriptors copied from one another by
+ * fork share it, seek position and all. It is reference counted, and
+ * the last close frees it.
+ *
+ * A file table maps descriptors to open files. It is a plain array
+ * indexed by descriptor. Only the process's own thread touches it
+ * (user processes have one thread), so lookups take no lock at all.
+ */
+
+#include <limits.h>
+#include <spinlock.h>
+
+struct vnode;
+struct lock;
+
+struct openfile {
+	struct vnode *of_vnode;
+	int of_accmode;			/* O_RDONLY, O_WRONLY or O_RDWR */
+	bool of_append;			/* writes go at the end */
+	struct lock *of_lock;		/* for I/O that uses of_offset */
+	off_t of_offset;		/* protected by of_lock */
+	struct spinlock of_reflock;
+	unsigned of_refcount;		/* protected by of_reflock */
+};
+
+struct filetable {
+	struct openfile *ft_files[OPEN_MAX];
+};
+
+/*
+ * Make an open file for VN, which the caller has opened and whose
+ * reference it hands over, with access mode ACCMODE.
+ */
+int openfile_create(struct vnode *vn, int accmode, struct openfile **ret);
+
+/*
+ * Open PATH (which may be modified) with the open() FLAGS and MODE.
+ */
+int openfile_open(char *path, int flags, mode_t mode, struct openfile **ret);
+
+void openfile_incref(struct openfile *of);
+void openfile_decref(struct openfile *of);
+
+/* May OF be read (written)? */
+bool openfile_readable(struct openfile *of);
+bool openfile_writable(struct openfile *of);
+
+/*
+ * Create an empty table, or, for a process started from the menu, one
+ * with the console open on descriptors 0, 1 and 2.
+ */
+struct filetable *filetable_create(void);
+int filetable_openconsole(struct filetable *ft);
+
+/* Close everything and free the table. */
+void filetable_destroy(struct filetable *ft);
+
+/* Make a copy for fork, sharing each open file. */
+int filetable_copy(struct filetable *ft, struct filetable **ret);
+
+/*
+ * Put OF at the lowest free descriptor, which is handed back in FD.
+ * The table takes over the caller's reference. EMFILE if full.
+ */
+int filetable_add(struct filetable *ft, struct openfile *of, int *fd);
+
+/*
+ * Make NEWFD refer to the file open on OLDFD, closing what was on
+ * NEWFD first if anything. EBADF if either is out of range or OLDFD
+ * isn't open.
+ */
+int filetable_dup2(struct filetable *ft, int oldfd, int newfd);
+
+/* Find the file open on FD, or EBADF. No reference is taken. */
+int filetable_get(struct filetable *ft, int fd, struct openfile **ret);
+
+/* Close FD, or EBADF. */
+int filetable_close(struct filetable *ft, int fd);
+
+#endif /* _FILE_H_ */
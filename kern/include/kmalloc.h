@@ -0,0 +1,56 @@
+#ifndef _KMALLOC_H_
+#define _KMALLOC_H_
+
+/*
+ * Per-cpu kmalloc magazines.
+ *
+ * kmalloc and kfree are declared in lib.h. This is the part of the
+ * subpage allocator that lives in struct cpu: for each block size, a
+ * small stack of free blocks that only this cpu allocates from and
+ * frees to. An empty stack is refilled from the shared pool, and a
+ * full one flushed back to it, KMAG_BATCH blocks at a time under one
+ * acquisition of kmalloc_spinlock.
+ */
+
+#include <spinlock.h>
+#include "opt-kmprof.h"
+
+/* Must match the number of subpage block sizes in kmalloc.c. */
+#define KMAG_NSIZES 8
+
+/* Blocks kept per size, and how many move per refill/flush. */
+#define KMAG_SIZE   16
+#define KMAG_BATCH  8
+
+struct kmag {
+	struct spinlock km_lock;
+	unsigned km_count[KMAG_NSIZES];
+	void *km_blocks[KMAG_NSIZES][KMAG_SIZE];
+	unsigned km_hits;		/* allocations served from the magazine */
+	unsigned km_misses;		/* allocations that went to the pool */
+	unsigned km_frees;		/* frees absorbed by the magazine */
+	unsigned km_flushes;		/* batches pushed back to the pool */
+};
+
+/* Set up the magazine for cpu number CPUNUM. Called from cpu_create. */
+void kmag_init(struct kmag *km, unsigned cpunum);
+
+/*
+ * Flush every cpu's magazine back to the shared pool. Returns true if
+ * that freed any pages. Used by the VM when memory runs out.
+ */
+bool kmag_drain(void);
+
+#if OPT_KMPROF
+/*
+ * Call-site profiling (options kmprof). kmalloc and kfree report
+ * each block, with the size class it was charged and the address
+ * kmalloc was called from; kmprof_printstats backs the kmprof menu
+ * command.
+ */
+void kmprof_alloc(void *ptr, size_t size, const void *caller);
+void kmprof_free(void *ptr);
+void kmprof_printstats(void);
+#endif
+
+#endif /* _KMALLOC_H_ */
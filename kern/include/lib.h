@@ -156,9 +156,10 @@ const char *strerror(int errcode);
  *
  * putch_prepare and putch_complete should be called around a series
  * of putch() calls, if printing in polling mode is a possibility.
- * kprintf does this.
+ * kprintf does this. putchars is putch for LEN chars at once.
  */
 void putch(int ch);
+void putchars(const char *buf, size_t len);
 void putch_prepare(void);
 void putch_complete(void);
 int getch(void);
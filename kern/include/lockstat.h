@@ -0,0 +1,52 @@
+#ifndef _LOCKSTAT_H_
+#define _LOCKSTAT_H_
+
+/*
+ * Lock contention statistics, built with "options lockstat".
+ *
+ * spinlock_acquire, lock_acquire and cv_wait report every acquisition
+ * (or wait) here, with whether it had to wait and for how long, and
+ * the matching releases report how long the lock was held. The
+ * lockstat menu command lists the locks that were waited for longest.
+ *
+ * Sleep locks and CVs are counted by name, so all the locks created
+ * with the same name (every process's wait_lock, say) add up to one
+ * line. Spinlocks have no names and are counted by the place they
+ * are acquired from instead; os161-addr2line names those.
+ *
+ * Nothing is recorded until lockstat_bootstrap has been called, since
+ * timing needs the clock.
+ */
+
+#include "opt-lockstat.h"
+
+#if OPT_LOCKSTAT
+
+struct spinlock;
+struct lock;
+struct cv;
+
+/* Start recording. Call once the clock device is attached. */
+void lockstat_bootstrap(void);
+
+/* Current time for the hooks below, or 0 if not recording. */
+uint64_t lockstat_now(void);
+
+/*
+ * Hooks. START is lockstat_now() from when the caller began trying
+ * to get the lock; CALLER is the return address of spinlock_acquire.
+ */
+void lockstat_spinlock_acquired(struct spinlock *lk, bool contended,
+				uint64_t start, const void *caller);
+void lockstat_spinlock_released(struct spinlock *lk);
+void lockstat_lock_acquired(struct lock *lock, bool contended,
+			    uint64_t start);
+void lockstat_lock_released(struct lock *lock);
+void lockstat_cv_waited(struct cv *cv, uint64_t start);
+
+/* Print the N locks with the most total wait time. */
+void lockstat_printstats(unsigned n);
+
+#endif /* OPT_LOCKSTAT */
+
+#endif /* _LOCKSTAT_H_ */
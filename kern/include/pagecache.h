@@ -0,0 +1,58 @@
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+/*
+ * Page cache for files mapped with MAP_SHARED.
+ *
+ * Every process mapping a given page of a given file maps the same
+ * frame. The cache holds one reference to the frame and each page
+ * table mapping it holds another, so a frame whose count is down to
+ * one is cached but unmapped, and pagecache_reclaim may drop it.
+ *
+ * A page is marked dirty on the first write fault through any mapping
+ * and written back by pagecache_flush (munmap, fsync, exit), before a
+ * write() to it, or when it is reclaimed. A page that is still mapped
+ * after being flushed stays dirty, since its mappers can keep writing
+ * without faulting.
+ *
+ * The cache has its own lock, which it drops for I/O; none of these
+ * may be called with vm_lock held except pagecache_markdirty, which
+ * does no I/O.
+ */
+
+#include <vm.h>
+
+struct vnode;
+
+/* Called from vm_paging_bootstrap. */
+void pagecache_bootstrap(void);
+
+/*
+ * Find the page of VN at OFFSET (page-aligned), reading it in if it
+ * isn't cached, and take a reference to its frame for the caller.
+ * FROMDISK says whether it had to be read.
+ */
+int pagecache_get(struct vnode *vn, off_t offset, paddr_t *pa, bool *fromdisk);
+
+/* Note that the cached page of VN at OFFSET has been written. */
+void pagecache_markdirty(struct vnode *vn, off_t offset);
+
+/* Write back dirty pages of VN with START <= offset < END. */
+int pagecache_flush(struct vnode *vn, off_t start, off_t end);
+
+/*
+ * Keep the cache in step with write() on VN over [START, END).
+ * pagecache_prewrite writes back dirty cached pages there first, so
+ * they can't later land on top of the new data; pagecache_postwrite
+ * then drops the pages nobody maps and rereads the mapped ones.
+ */
+int pagecache_prewrite(struct vnode *vn, off_t start, off_t end);
+void pagecache_postwrite(struct vnode *vn, off_t start, off_t end);
+
+/*
+ * Drop one cached page that nobody maps, writing it back first if
+ * it is dirty. Returns false if there was nothing to drop.
+ */
+bool pagecache_reclaim(void);
+
+#endif /* _PAGECACHE_H_ */
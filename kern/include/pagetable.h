@@ -0,0 +1,77 @@
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Per-address-space page tables.
+ *
+ * Two levels, split 10/10/12 like the MIPS virtual address: a
+ * directory indexed by the top ten bits of the address points at
+ * page-sized second-level tables of PTEs. Second-level tables are
+ * only allocated for parts of the address space that have actually
+ * been touched, so a sparse program costs one directory plus a page
+ * per 4M chunk it uses.
+ *
+ * A PTE holds the physical frame in the PAGE_FRAME bits and flags in
+ * the low bits. A page that has been swapped out keeps its swap slot
+ * in the PAGE_FRAME bits instead and has PTE_SWAPPED set.
+ *
+ * PTE_DIRTY means the page no longer matches where it came from (the
+ * executable, zero fill, or swap). Clean pages are simply dropped on
+ * eviction and faulted back in from their source.
+ *
+ * PTE_SHARED pages are mapped from the page cache. They are never
+ * evicted while mapped and are shared, not copied, across fork.
+ *
+ * PTE_BUSY pages are on their way in or out, with vm_lock dropped
+ * for the I/O; whoever set it clears it. The other bits say where
+ * the page was before the transfer started.
+ */
+
+#include <vm.h>
+
+typedef uint32_t pte_t;
+
+#define PTE_VALID   0x00000001	/* frame is resident */
+#define PTE_COW     0x00000002	/* frame is shared; copy before writing */
+#define PTE_SWAPPED 0x00000004	/* page is in swap, not resident */
+#define PTE_DIRTY   0x00000008	/* page has been written */
+#define PTE_SHARED  0x00000010	/* frame belongs to the page cache */
+#define PTE_BUSY    0x00000020	/* I/O in progress; wait for it */
+
+#define PTE_PADDR(pte)  ((paddr_t)((pte) & PAGE_FRAME))
+#define PTE_SWAPSLOT(pte)  ((unsigned)((pte) >> 12))
+#define PTE_MKSWAP(slot)   (((pte_t)(slot) << 12) | PTE_SWAPPED)
+
+struct pagetable;
+
+struct pagetable *pt_create(void);
+
+/*
+ * Free the tables, drop a reference on every resident frame and
+ * release every swap slot.
+ */
+void pt_destroy(struct pagetable *pt);
+
+/*
+ * Unmap the page at VA, releasing its frame or swap slot. The caller
+ * must make sure no TLB still maps it.
+ */
+void pt_clear(struct pagetable *pt, vaddr_t va);
+
+/*
+ * Make DST share every resident frame of SRC copy-on-write. Both
+ * sides' PTEs are marked PTE_COW, so the caller must flush any
+ * writable TLB entries SRC has loaded. Swapped-out pages get a
+ * private copy of their swap slot. PTE_SHARED pages are simply
+ * shared.
+ */
+int pt_copy(struct pagetable *src, struct pagetable *dst);
+
+/*
+ * Find the PTE for VA. If CREATE is set, the second-level table is
+ * allocated if it doesn't exist yet; returns NULL if that fails, or
+ * if CREATE is clear and there is no table.
+ */
+pte_t *pt_lookup(struct pagetable *pt, vaddr_t va, bool create);
+
+#endif /* _PAGETABLE_H_ */
@@ -0,0 +1,21 @@
+#ifndef _PIPE_H_
+#define _PIPE_H_
+
+/*
+ * Anonymous pipes.
+ *
+ * A pipe is a page-sized ring buffer with two vnodes, one for each
+ * end. Reads block until there is data or every writer has closed
+ * (then they return 0); writes block until there is room, and fail
+ * with EPIPE once every reader has closed. A write of PIPE_BUF bytes
+ * or less is never interleaved with other writes.
+ *
+ * The vnodes come back already opened, as if by vfs_open, so they are
+ * let go of with vfs_close.
+ */
+
+struct vnode;
+
+int pipe_create(struct vnode **readvn, struct vnode **writevn);
+
+#endif /* _PIPE_H_ */
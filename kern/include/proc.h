@@ -45,8 +45,19 @@ struct addrspace;
 struct vnode;
 #ifdef UW
 struct semaphore;
+struct filetable;
 #endif // UW
 
+/*
+ * CPU usage, in hardclocks and context switches. See struct thread.
+ */
+struct procusage {
+	unsigned pu_uticks;
+	unsigned pu_kticks;
+	unsigned pu_nvcsw;
+	unsigned pu_nivcsw;
+};
+
 /*
  * Process structure.
  */
@@ -61,13 +72,13 @@ struct proc {
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
 
+	/* Accounting; protected by p_lock */
+	struct procusage p_usage;	/* threads that have left */
+	struct procusage p_cusage;	/* exited children, and theirs */
+
 #ifdef UW
-  /* a vnode to refer to the console device */
-  /* this is a quick-and-dirty way to get console writes working */
-  /* you will probably need to change this when implementing file-related
-     system calls, since each process will need to keep track of all files
-     it has opened, not just the console. */
-  struct vnode *console;                /* a vnode for the console device */
+  /* open files, by descriptor; see file.h */
+  struct filetable *p_files;
 #endif
 
 #if OPT_A2
@@ -109,6 +120,12 @@ int proc_addthread(struct proc *proc, struct thread *t);
 /* Detach a thread from its process. */
 void proc_remthread(struct thread *t);
 
+/*
+ * Get the CPU usage of a process: the threads it has now and the ones
+ * it has had, or if CHILDREN is true, its children that have exited.
+ */
+void proc_getusage(struct proc *proc, bool children, struct procusage *pu);
+
 /* Fetch the address space of the current process. */
 struct addrspace *curproc_getas(void);
 
@@ -116,8 +133,14 @@ struct addrspace *curproc_getas(void);
 struct addrspace *curproc_setas(struct addrspace *);
 
 #if OPT_A2
-pid_t new_pid(void);
-struct proc* look_through_children(struct array* children, pid_t pid);
+/* Is PID in use by some process, running or exited? */
+bool pid_exists(pid_t pid);
+
+/*
+ * Find the child of PARENT, running or exited, whose pid is PID, or
+ * NULL if it has none. PARENT should be curproc.
+ */
+struct proc *proc_getchild(struct proc *parent, pid_t pid);
 #endif
 
 #endif /* _PROC_H_ */
@@ -0,0 +1,67 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+/*
+ * Object caches.
+ *
+ * A cache hands out objects of one fixed size, carved out of whole
+ * pages ("slabs"). Each slab starts with a small header recording
+ * which cache it belongs to and which of its objects are free, so
+ * freeing an object finds its slab by rounding the address down to
+ * the page: both allocation and free are O(1), no matter how big the
+ * heap gets.
+ *
+ * If a constructor is given, it is run once on each object when its
+ * slab is created, not on every allocation. Objects must be handed
+ * back to kmem_cache_free in their constructed state, which the cache
+ * leaves alone while they are free.
+ *
+ * A cache can be created with kmem_cache_create, or defined
+ * statically with KMEM_CACHE_INITIALIZER, which needs no setup and so
+ * can be used before (or by) anything that bootstraps.
+ */
+
+#include <spinlock.h>
+
+struct slab;
+
+/* Every object is aligned to this. */
+#define KMEM_ALIGN 8
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;			/* object size, a multiple of KMEM_ALIGN */
+	void (*kc_ctor)(void *obj);
+	struct spinlock kc_lock;
+	struct slab *kc_partial;	/* slabs with some objects free */
+	struct slab *kc_empty;		/* one wholly free slab kept in reserve */
+	unsigned kc_nslabs;
+	unsigned kc_inuse;		/* objects allocated */
+	bool kc_listed;			/* on the list kmem_printstats walks */
+	struct kmem_cache *kc_next;
+};
+
+#define KMEM_CACHE_INITIALIZER(name, size, ctor) \
+	{ name, ROUNDUP(size, KMEM_ALIGN), ctor, SPINLOCK_INITIALIZER, \
+	  NULL, NULL, 0, 0, false, NULL }
+
+/*
+ * Create a cache of SIZE-byte objects, which must fit a few to a
+ * page. CTOR may be NULL. Returns NULL if out of memory.
+ */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     void (*ctor)(void *obj));
+
+/* Destroy a cache. Every object must have been freed. */
+void kmem_cache_destroy(struct kmem_cache *kc);
+
+/* Allocate an object; NULL if out of memory. */
+void *kmem_cache_alloc(struct kmem_cache *kc);
+
+/* Return an object to the cache it came from. */
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+
+/* Print usage of every cache that has allocated anything. */
+void kmem_printstats(void);
+
+#endif /* _SLAB_H_ */
@@ -0,0 +1,43 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space.
+ *
+ * Evicted user pages are written to the raw disk lhd1raw:, one page
+ * per slot; a bitmap tracks which slots are in use. If the disk is
+ * missing, swap_bootstrap says so and every swap_alloc fails, which
+ * leaves the VM to report ENOMEM as it did before.
+ *
+ * swap_in and swap_out bump VMSTAT_SWAP_FILE_READ/WRITE.
+ *
+ * The I/O goes straight to the disk driver, not through VOP_READ and
+ * VOP_WRITE, so it never takes vfs_biglock. A thread holding that
+ * can therefore wait for a page on its way to swap, and swap can be
+ * written with vm_lock held.
+ */
+
+#include <vm.h>
+
+#define SWAP_DEVICE "lhd1raw:"
+
+/* Open the swap disk. Called from vm_bootstrap. */
+void swap_bootstrap(void);
+
+/* True if there is a swap disk. */
+bool swap_enabled(void);
+
+/* Reserve a free slot. Returns ENOSPC if swap is full (or missing). */
+int swap_alloc(unsigned *slot);
+
+/* Release a slot. */
+void swap_free(unsigned slot);
+
+/* Copy a page between frame PA and SLOT. */
+int swap_in(unsigned slot, paddr_t pa);
+int swap_out(unsigned slot, paddr_t pa);
+
+/* Copy the contents of SLOT into a freshly allocated slot. */
+int swap_dup(unsigned slot, unsigned *newslot);
+
+#endif /* _SWAP_H_ */
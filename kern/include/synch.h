@@ -36,6 +36,7 @@
 
 
 #include <spinlock.h>
+#include "opt-lockstat.h"
 
 /*
  * Dijkstra-style semaphore.
@@ -69,6 +70,10 @@ void V(struct semaphore *);
  * When the lock is created, no thread should be holding it. Likewise,
  * when the lock is destroyed, no thread should be holding it.
  *
+ * Locks are adaptive: a thread that finds the lock held spins while
+ * the owner is running on another cpu, since it will likely let go
+ * before a sleep and wakeup could be paid for, and sleeps otherwise.
+ *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
  */
@@ -77,7 +82,12 @@ struct lock {
 	struct wchan *lk_wchan;
 	struct spinlock lk_lock;
 	volatile struct thread *lk_owner;
+	struct cpu *volatile lk_ownercpu; /* where lk_owner took the lock */
 	volatile bool held;
+#if OPT_LOCKSTAT
+	struct lockstat *lk_stat;	/* counters for locks of this name */
+	uint64_t lk_acquired;		/* when lk_owner got it */
+#endif
         // add what you need here
         // (don't forget to mark things volatile as needed)
 };
@@ -118,6 +128,9 @@ void lock_destroy(struct lock *);
 struct cv {
         char *cv_name;
 	struct wchan *cv_wchan;
+#if OPT_LOCKSTAT
+	struct lockstat *cv_stat;	/* counters for cvs of this name */
+#endif
         // add what you need here
         // (don't forget to mark things volatile as needed)
 };
@@ -143,4 +156,43 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers can hold the lock at once, or one writer.
+ * Writers are preferred: once a writer is waiting, new readers wait
+ * behind it, so a steady stream of readers can't starve writers. (It
+ * follows that a thread must not take a read lock it already holds;
+ * with a writer waiting in between, that would deadlock.)
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+struct rwlock {
+	char *rw_name;
+	struct spinlock rw_lock;
+	struct wchan *rw_readwchan;	/* readers waiting */
+	struct wchan *rw_writewchan;	/* writers waiting */
+	volatile unsigned rw_readers;	/* readers holding the lock */
+	volatile unsigned rw_writerswaiting;
+	struct thread *volatile rw_writer; /* writer holding it, if any */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock shared with other readers.
+ *    rwlock_acquire_write - Get the lock exclusively.
+ *    rwlock_release       - Give up the lock, whichever way it's held.
+ *    rwlock_do_i_hold_write - Return true if the current thread is
+ *                   the writer. (There is no way to ask about readers.)
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
@@ -30,6 +30,8 @@
 #ifndef _SYSCALL_H_
 #define _SYSCALL_H_
 
+#include "opt-A3.h"
+
 
 struct trapframe; /* from <machine/trapframe.h> */
 
@@ -59,12 +61,32 @@ int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
 
 #ifdef UW
+int sys_open(userptr_t path, int flags, mode_t mode, int *retval);
+int sys_close(int fdesc);
+int sys_pipe(userptr_t fds);
+int sys_dup2(int oldfd, int newfd, int *retval);
+int sys_read(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
 int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
+int sys_pread(int fdesc, userptr_t ubuf, size_t nbytes, off_t pos, int *retval);
+int sys_pwrite(int fdesc, userptr_t ubuf, size_t nbytes, off_t pos, int *retval);
+int sys_readv(int fdesc, userptr_t iov, int iovcnt, int *retval);
+int sys_writev(int fdesc, userptr_t iov, int iovcnt, int *retval);
+int sys_lseek(int fdesc, off_t pos, int whence, off_t *retval);
+int sys_fsync(int fdesc);
 void sys__exit(int exitcode);
 int sys_getpid(pid_t *retval);
 int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
 pid_t sys_fork(struct trapframe *parent_tf, pid_t *retval);
 int sys_execv(const char *program, char **args);
+int sys_getrusage(int who, userptr_t usage);
+int sys_setaffinity(pid_t pid, uint32_t mask);
 #endif // UW
 
+#if OPT_A3
+int sys_sbrk(intptr_t amount, vaddr_t *retval);
+int sys_mmap(vaddr_t addr, size_t len, int prot, int flags, userptr_t stackargs,
+             vaddr_t *retval);
+int sys_munmap(vaddr_t addr, size_t len);
+#endif
+
 #endif /* _SYSCALL_H_ */
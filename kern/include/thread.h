@@ -55,6 +55,10 @@ struct cpu;
 /* Macro to test if two addresses are on the same kernel stack */
 #define SAME_STACK(p1, p2)     (((p1) & STACK_MASK) == ((p2) & STACK_MASK))
 
+/* Affinity masks: bit N set means the thread may run on cpu number N. */
+#define CPUMASK_ALL            (~(uint32_t)0)
+#define CPUMASK_HAS(mask, n)   (((mask) & ((uint32_t)1 << (n))) != 0)
+
 
 /* States a thread can be in. */
 typedef enum {
@@ -84,6 +88,32 @@ struct thread {
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
 
+	/*
+	 * Scheduling fields. t_prio is the run queue the thread goes
+	 * on (0 is the most urgent); t_quantum counts the hardclocks
+	 * it has run at that priority.
+	 */
+	unsigned t_prio;
+	unsigned t_quantum;
+	uint32_t t_affinity;		/* CPUs this thread may run on */
+
+	/*
+	 * Accounting. Hardclocks that went off while this thread was
+	 * running, split by whether they interrupted user or kernel
+	 * code, and context switches it made by sleeping or yielding
+	 * (voluntary) or had forced on it by the scheduler.
+	 */
+	unsigned t_uticks;
+	unsigned t_kticks;
+	unsigned t_nvcsw;
+	unsigned t_nivcsw;
+
+	/*
+	 * User stack pointer as of the last trap from user mode, which
+	 * the VM goes by to tell stack growth from stray accesses.
+	 */
+	vaddr_t t_usersp;
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -98,6 +128,7 @@ struct thread {
 	 * rather than per-cpu or global?
 	 */
 	bool t_in_interrupt;		/* Are we in an interrupt? */
+	bool t_intr_user;		/* Did it interrupt user mode? */
 	int t_curspl;			/* Current spl*() state */
 	int t_iplhigh_count;		/* # of times IPL has been raised */
 
@@ -163,10 +194,35 @@ void thread_yield(void);
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Charge a clock tick to the current thread, and switch away from it
+ * if it has used up its quantum or something more urgent is waiting.
+ * Called from the timer interrupt.
+ */
+void thread_tick(void);
+
+/*
+ * Print per-cpu scheduling counters (steals and migrations).
+ */
+void thread_printstats(void);
+
+/*
+ * CPU affinity. Both of these fail with EINVAL if MASK names no cpu
+ * that exists (see CPUMASK_HAS).
+ *
+ * thread_setaffinity restricts the current thread to the cpus in MASK,
+ * and moves it before returning if it may no longer run where it is.
+ *
+ * thread_setaffinity_other does the same for another thread T, and
+ * may be called with spinlocks held. A sleeping T moves when it wakes,
+ * and a runnable one when its cpu next picks it. A T that is running
+ * on a cpu it may no longer use can only be moved off once that cpu
+ * has something else to run: its cpu is added to the mask *KICK, to
+ * be handed to thread_kick once no spinlocks are held. If that fails,
+ * T still moves the next time it sleeps or is preempted.
  */
-void thread_consider_migration(void);
+int thread_setaffinity(uint32_t mask);
+int thread_setaffinity_other(struct thread *t, uint32_t mask, uint32_t *kick);
+int thread_kick(uint32_t cpus);
 
 
 #endif /* _THREAD_H_ */
@@ -38,6 +38,7 @@
 
 
 #include <machine/vm.h>
+#include "opt-A3.h"
 
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
@@ -59,5 +60,27 @@ void free_kpages(vaddr_t addr);
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+#if OPT_A3
+/* Set up paging and swap; called from vm_bootstrap. */
+void vm_paging_bootstrap(void);
+
+/*
+ * Allocate NPAGES contiguous frames from the coremap, paging out user
+ * pages to make room if necessary. Returns 0 if that doesn't help.
+ */
+paddr_t vm_getframes(unsigned long npages);
+
+/* Write back the cached pages of VN that shared mappings dirtied. */
+struct vnode;
+int vm_fsync(struct vnode *vn);
+
+/*
+ * Called around write() to VN over [START, END) so that pages of it
+ * cached for shared mappings don't go stale or clobber the new data.
+ */
+int vm_prewrite(struct vnode *vn, off_t start, off_t end);
+void vm_postwrite(struct vnode *vn, off_t start, off_t end);
+#endif
+
 
 #endif /* _VM_H_ */
@@ -41,13 +41,19 @@
  * process that will have more than one thread is the kernel process.
  */
 #include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <limits.h>
+#include <mainbus.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
 #include <vnode.h>
 #include <vfs.h>
 #include <synch.h>
-#include <kern/fcntl.h>  
+#include <slab.h>
+#include <file.h>
+#include <vm.h>
 
 #include "opt-A2.h"
 
@@ -55,6 +61,10 @@
  * The process for the kernel; this holds all the kernel-only threads.
  */
 struct proc *kproc;
+
+/* Proc structures. */
+static struct kmem_cache proc_cache =
+	KMEM_CACHE_INITIALIZER("proc", sizeof(struct proc), NULL);
 /*
  * Mechanism for making the kernel menu thread sleep while processes are running
  */
@@ -69,36 +79,153 @@ struct semaphore *no_proc_sem;
 #endif  // UW
 
 #if OPT_A2
-//list of availiable pids
-bool volatile pid_list[66];
-//lock to protect pid_list
-struct lock *pid_lock;
-
-//get a new availiable pid, else return -1
-pid_t new_pid() {
-	if(curthread == NULL) {
+/*
+ * Process table, indexed by pid. A free slot holds the next pid on
+ * the free list instead of a proc. The free list is FIFO, so a freed
+ * pid goes to the back and is handed out again as late as possible.
+ * When the list runs dry the table doubles, up to pid_limit, which
+ * is set at boot from the amount of RAM.
+ */
+struct pidslot {
+	struct proc *ps_proc;	//NULL if free
+	pid_t ps_nextfree;	//next free pid if free, -1 at the tail
+};
+
+#define PID_TABLE_INITSIZE 64
+//a process can't run in less than a kernel stack and a couple of pages
+#define PROC_MINMEM (STACK_SIZE + 2 * PAGE_SIZE)
+
+static struct pidslot *pid_table;
+static unsigned pid_tablesize;
+static unsigned pid_limit;
+static pid_t pid_freehead;
+static pid_t pid_freetail;
+//lock to protect the process table; lookups only need to read it
+static struct rwlock *pid_lock;
+
+//put PID on the back of the free list
+static void pid_putfree(pid_t pid) {
+	KASSERT(rwlock_do_i_hold_write(pid_lock));
+
+	pid_table[pid].ps_proc = NULL;
+	pid_table[pid].ps_nextfree = -1;
+	if (pid_freetail < 0) {
+		pid_freehead = pid;
+	}
+	else {
+		pid_table[pid_freetail].ps_nextfree = pid;
+	}
+	pid_freetail = pid;
+}
+
+//double the table and free the new pids, or ENPROC if it's at pid_limit
+static int pid_grow(void) {
+	struct pidslot *newtable;
+	unsigned newsize, i;
+
+	KASSERT(rwlock_do_i_hold_write(pid_lock));
+
+	if (pid_tablesize >= pid_limit) {
+		return ENPROC;
+	}
+	newsize = pid_tablesize == 0 ? PID_TABLE_INITSIZE : pid_tablesize * 2;
+	if (newsize > pid_limit) {
+		newsize = pid_limit;
+	}
+	newtable = kmalloc(newsize * sizeof(struct pidslot));
+	if (newtable == NULL) {
+		return ENOMEM;
+	}
+	if (pid_table != NULL) {
+		memcpy(newtable, pid_table, pid_tablesize * sizeof(struct pidslot));
+		kfree(pid_table);
+	}
+	pid_table = newtable;
+	for (i = pid_tablesize; i < newsize; i++) {
+		pid_table[i].ps_proc = NULL;
+		pid_table[i].ps_nextfree = -1;
+	}
+	for (i = pid_tablesize < PID_MIN ? PID_MIN : pid_tablesize; i < newsize; i++) {
+		pid_putfree(i);
+	}
+	pid_tablesize = newsize;
+	return 0;
+}
+
+//give PROC a pid and enter it in the table
+static int pid_alloc(struct proc *proc) {
+	pid_t pid;
+	int result;
+
+	if(kproc == NULL) {
+		//the kernel process is not in the table
+		proc->pid = 0;
 		return 0;
 	}
-	lock_acquire(pid_lock);
-	for(int i = 2; i < 66; i++) {
-		if (pid_list[i] == 0) {
-			pid_list[i] = 1;
-			lock_release(pid_lock);
-			return i;
+	rwlock_acquire_write(pid_lock);
+	if (pid_freehead < 0) {
+		result = pid_grow();
+		if (result) {
+			rwlock_release(pid_lock);
+			return result;
 		}
 	}
-	lock_release(pid_lock);
-	return -1;
+	pid = pid_freehead;
+	pid_freehead = pid_table[pid].ps_nextfree;
+	if (pid_freehead < 0) {
+		pid_freetail = -1;
+	}
+	pid_table[pid].ps_proc = proc;
+	rwlock_release(pid_lock);
+
+	proc->pid = pid;
+	return 0;
+}
+
+//take PID out of the table, for reuse
+static void pid_free(pid_t pid) {
+	rwlock_acquire_write(pid_lock);
+	KASSERT(pid >= PID_MIN && (unsigned)pid < pid_tablesize);
+	KASSERT(pid_table[pid].ps_proc != NULL);
+	pid_putfree(pid);
+	rwlock_release(pid_lock);
 }
 
-struct proc* look_through_children(struct array* children, pid_t pid) {
-	for(unsigned i = 0; i< array_num(children); i++) {
-		struct proc* child = array_get(children,i);
-		if(child->pid == pid) {
-			return child;
+//is PID in use by some process?
+bool pid_exists(pid_t pid) {
+	bool ret;
+
+	if(pid < 0) {
+		return false;
+	}
+	rwlock_acquire_read(pid_lock);
+	ret = (unsigned)pid < pid_tablesize && pid_table[pid].ps_proc != NULL;
+	rwlock_release(pid_lock);
+	return ret;
+}
+
+/*
+ * Look PID up in the table. A proc is taken out of the table before
+ * it is freed, so it can be looked at while the read lock is held;
+ * and a child can only be freed by its parent, so once we know it's
+ * PARENT's, PARENT can go on using it.
+ */
+struct proc *proc_getchild(struct proc *parent, pid_t pid) {
+	struct proc *p;
+
+	if(pid < 0) {
+		return NULL;
+	}
+	rwlock_acquire_read(pid_lock);
+	p = NULL;
+	if ((unsigned)pid < pid_tablesize) {
+		p = pid_table[pid].ps_proc;
+		if (p != NULL && p->p_parent != parent) {
+			p = NULL;
 		}
 	}
-	return NULL;
+	rwlock_release(pid_lock);
+	return p;
 }
 #endif
 
@@ -110,13 +237,13 @@ struct proc *
 proc_create(const char *name)
 {
 	struct proc *proc;
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(&proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(&proc_cache, proc);
 		return NULL;
 	}
 	threadarray_init(&proc->p_threads);
@@ -125,17 +252,16 @@ proc_create(const char *name)
 	proc->p_addrspace = NULL;
 	/* VFS fields */
 	proc->p_cwd = NULL;
+	/* Accounting fields */
+	bzero(&proc->p_usage, sizeof(proc->p_usage));
+	bzero(&proc->p_cusage, sizeof(proc->p_cusage));
 #ifdef UW
-	proc->console = NULL;
+	proc->p_files = NULL;
 #endif // UW
 
 #if OPT_A2
 	proc->exited = 0;
 	proc->exit_code = 0;
-	proc->pid = new_pid();
-	if(proc->pid == -1) {
-		return NULL;
-	}
 	proc->p_parent = NULL;
 
 	proc->p_living_children = array_create();
@@ -147,21 +273,33 @@ proc_create(const char *name)
 	proc->set_lock = lock_create("set_lock");
 	if(proc->set_lock == NULL) {
 		kfree(proc->p_name);
-		kfree(proc);
+		kmem_cache_free(&proc_cache, proc);
 		return NULL;
 	}
 
 	proc->wait_lock = lock_create("wait_lock");
 	if(proc->wait_lock == NULL) {
 		kfree(proc->p_name);
-		kfree(proc);
+		kmem_cache_free(&proc_cache, proc);
 		return NULL;
 	}
 
 	proc->wait_cv = cv_create("wait_cv");
 	if(proc->wait_cv == NULL) {
 		kfree(proc->p_name);
-		kfree(proc);
+		kmem_cache_free(&proc_cache, proc);
+		return NULL;
+	}
+
+	//last, so nobody can find it half made
+	if(pid_alloc(proc)) {
+		cv_destroy(proc->wait_cv);
+		lock_destroy(proc->wait_lock);
+		lock_destroy(proc->set_lock);
+		array_destroy(proc->p_dead_children);
+		array_destroy(proc->p_living_children);
+		kfree(proc->p_name);
+		kmem_cache_free(&proc_cache, proc);
 		return NULL;
 	}
 #endif
@@ -213,8 +351,9 @@ proc_destroy(struct proc *proc)
 #endif // UW
 
 #ifdef UW
-	if (proc->console) {
-	  vfs_close(proc->console);
+	/* normally closed by sys__exit already */
+	if (proc->p_files) {
+	  filetable_destroy(proc->p_files);
 	}
 #endif // UW
 	threadarray_cleanup(&proc->p_threads);
@@ -261,9 +400,7 @@ proc_destroy(struct proc *proc)
 	DEBUG(DB_SYSCALL,"child array destroyed\n");
 
 	//free the pid for reuse
-	lock_acquire(pid_lock);
-	pid_list[proc->pid] = 0;
-	lock_release(pid_lock);
+	pid_free(proc->pid);
 
 	//destroy internal lock
 	lock_destroy(proc->set_lock);
@@ -271,7 +408,7 @@ proc_destroy(struct proc *proc)
 	cv_destroy(proc->wait_cv);
 #endif
 	kfree(proc->p_name);
-	kfree(proc);
+	kmem_cache_free(&proc_cache, proc);
 #ifdef UW
 	/* decrement the process count */
         /* note: kproc is not included in the process count, but proc_destroy
@@ -294,14 +431,26 @@ void
 proc_bootstrap(void)
 {
 #if OPT_A2
-  for (int i = 0; i < 66; i++) {
-	  pid_list[i] = 0;
-  }
-  pid_lock = lock_create("pid_lock");
+  pid_lock = rwlock_create("pid_lock");
   if (pid_lock == NULL) {
   	panic("could not create pid_lock\n");
   }
-
+  pid_limit = mainbus_ramsize() / PROC_MINMEM;
+  if (pid_limit < PID_TABLE_INITSIZE) {
+	  pid_limit = PID_TABLE_INITSIZE;
+  }
+  if (pid_limit > PID_MAX + 1) {
+	  pid_limit = PID_MAX + 1;
+  }
+  pid_table = NULL;
+  pid_tablesize = 0;
+  pid_freehead = -1;
+  pid_freetail = -1;
+  rwlock_acquire_write(pid_lock);
+  if (pid_grow()) {
+	  panic("could not create the process table\n");
+  }
+  rwlock_release(pid_lock);
 #endif
   kproc = proc_create("[kernel]");
   if (kproc == NULL) {
@@ -324,27 +473,22 @@ proc_bootstrap(void)
  *
  * It will have no address space and will inherit the current
  * process's (that is, the kernel menu's) current directory.
+ *
+ * It gets a copy of the current process's file table, or if that
+ * is the kernel menu, which has none, the console on descriptors
+ * 0, 1 and 2.
  */
 struct proc *
 proc_create_runprogram(const char *name)
 {
 	struct proc *proc;
-	char *console_path;
+#ifdef UW
+	int result;
+#endif
 	proc = proc_create(name);
 	if (proc == NULL) {
 		return NULL;
 	}
-#ifdef UW
-	/* open the console - this should always succeed */
-	console_path = kstrdup("con:");
-	if (console_path == NULL) {
-	  panic("unable to copy console path name during process creation\n");
-	}
-	if (vfs_open(console_path,O_WRONLY,0,&(proc->console))) {
-	  panic("unable to open the console during process creation\n");
-	}
-	kfree(console_path);
-#endif // UW
 	  
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -372,6 +516,20 @@ proc_create_runprogram(const char *name)
 	P(proc_count_mutex); 
 	proc_count++;
 	V(proc_count_mutex);
+
+	/* done last, so proc_destroy can clean up if it fails */
+	if (curproc->p_files != NULL) {
+		result = filetable_copy(curproc->p_files, &proc->p_files);
+	}
+	else {
+		proc->p_files = filetable_create();
+		result = proc->p_files == NULL ? ENOMEM :
+			filetable_openconsole(proc->p_files);
+	}
+	if (result) {
+		proc_destroy(proc);
+		return NULL;
+	}
 #endif // UW
 	return proc;
 }
@@ -410,6 +568,11 @@ proc_remthread(struct thread *t)
 	for (i=0; i<num; i++) {
 		if (threadarray_get(&proc->p_threads, i) == t) {
 			threadarray_remove(&proc->p_threads, i);
+			/* Keep what it used. */
+			proc->p_usage.pu_uticks += t->t_uticks;
+			proc->p_usage.pu_kticks += t->t_kticks;
+			proc->p_usage.pu_nvcsw += t->t_nvcsw;
+			proc->p_usage.pu_nivcsw += t->t_nivcsw;
 			spinlock_release(&proc->p_lock);
 			t->t_proc = NULL;
 			return;
@@ -419,6 +582,31 @@ proc_remthread(struct thread *t)
 	spinlock_release(&proc->p_lock);
 	panic("Thread (%p) has escaped from its process (%p)\n", t, proc);
 }
+
+void
+proc_getusage(struct proc *proc, bool children, struct procusage *pu)
+{
+	struct thread *t;
+	unsigned i, num;
+
+	spinlock_acquire(&proc->p_lock);
+	if (children) {
+		*pu = proc->p_cusage;
+	}
+	else {
+		*pu = proc->p_usage;
+		num = threadarray_num(&proc->p_threads);
+		for (i=0; i<num; i++) {
+			t = threadarray_get(&proc->p_threads, i);
+			pu->pu_uticks += t->t_uticks;
+			pu->pu_kticks += t->t_kticks;
+			pu->pu_nvcsw += t->t_nvcsw;
+			pu->pu_nivcsw += t->t_nivcsw;
+		}
+	}
+	spinlock_release(&proc->p_lock);
+}
+
 /*
  * Fetch the address space of the current process. Caution: it isn't
  * refcounted. If you implement multithreaded processes, make sure to
@@ -50,6 +50,14 @@
 #include <test.h>
 #include <version.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-A3.h"
+#include "opt-lockstat.h"
+#if OPT_A3
+#include <uw-vmstats.h>
+#endif
+#if OPT_LOCKSTAT
+#include <lockstat.h>
+#endif
 
 
 /*
@@ -120,6 +128,10 @@ boot(void)
 	/* Now do pseudo-devices. */
 	pseudoconfig();
 	kprintf("\n");
+#if OPT_LOCKSTAT
+	/* The clock is attached now, so lock waits can be timed. */
+	lockstat_bootstrap();
+#endif
 
 	/* Late phase of initialization. */
 	vm_bootstrap();
@@ -146,6 +158,9 @@ shutdown(void)
 {
 
 	kprintf("Shutting down.\n");
+#if OPT_A3
+	vmstats_print();
+#endif
 	
 	vfs_clearbootfs();
 	vfs_clearcurdir();
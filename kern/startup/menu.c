@@ -42,9 +42,20 @@
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <slab.h>
+#include <kmalloc.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-A3.h"
+#include "opt-kmprof.h"
+#include "opt-lockstat.h"
+#if OPT_A3
+#include <coremap.h>
+#endif
+#if OPT_LOCKSTAT
+#include <lockstat.h>
+#endif
 
 /*
  * In-kernel menu and command dispatcher.
@@ -399,10 +410,65 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	kmem_printstats();
+#if OPT_A3
+	coremap_printstats();
+#endif
 	
 	return 0;
 }
 
+static
+int
+cmd_threadstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printstats();
+	return 0;
+}
+
+#if OPT_KMPROF
+static
+int
+cmd_kmprof(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kmprof_printstats();
+	return 0;
+}
+#endif
+
+#if OPT_LOCKSTAT
+/*
+ * Command for listing the most waited-for locks.
+ */
+static
+int
+cmd_lockstat(int nargs, char **args)
+{
+	int n = 10;
+
+	if (nargs > 2) {
+		kprintf("Usage: lockstat [count]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		n = atoi(args[1]);
+		if (n <= 0) {
+			kprintf("Usage: lockstat [count]\n");
+			return EINVAL;
+		}
+	}
+
+	lockstat_printstats(n);
+	return 0;
+}
+#endif
+
 static
 int
 cmd_dbthreads(int nargs, char **args)
@@ -484,6 +550,8 @@ static const char *testmenu[] = {
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] Lock benchmark                ",
+	"[sy5] Rwlock test                   ",
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -524,6 +592,13 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[ts] Thread scheduling stats        ",
+#if OPT_KMPROF
+	"[kmprof] kmalloc call site profile  ",
+#endif
+#if OPT_LOCKSTAT
+	"[lockstat] Lock contention stats    ",
+#endif
 	"[dth] Enable DB_THREADS	     ",
 	"[q] Quit and shut down              ",
 	NULL
@@ -581,6 +656,13 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "ts",         cmd_threadstats },
+#if OPT_KMPROF
+	{ "kmprof",     cmd_kmprof },
+#endif
+#if OPT_LOCKSTAT
+	{ "lockstat",   cmd_lockstat },
+#endif
 
 	/* db_threads */
 	{"dth", 	cmd_dbthreads},
@@ -601,6 +683,8 @@ static struct {
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	lockbench },
+	{ "sy5",	rwtest },
 #ifdef UW
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
@@ -0,0 +1,253 @@
+/*
+ * Open files and per-process file tables. See file.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <synch.h>
+#include <slab.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <file.h>
+
+static struct kmem_cache openfile_cache =
+	KMEM_CACHE_INITIALIZER("openfile", sizeof(struct openfile), NULL);
+
+int
+openfile_create(struct vnode *vn, int accmode, struct openfile **ret)
+{
+	struct openfile *of;
+
+	KASSERT(accmode == O_RDONLY || accmode == O_WRONLY ||
+		accmode == O_RDWR);
+
+	of = kmem_cache_alloc(&openfile_cache);
+	if (of == NULL) {
+		return ENOMEM;
+	}
+	of->of_lock = lock_create("openfile");
+	if (of->of_lock == NULL) {
+		kmem_cache_free(&openfile_cache, of);
+		return ENOMEM;
+	}
+
+	of->of_vnode = vn;
+	of->of_accmode = accmode;
+	of->of_append = false;
+	of->of_offset = 0;
+	spinlock_init(&of->of_reflock);
+	of->of_refcount = 1;
+
+	*ret = of;
+	return 0;
+}
+
+int
+openfile_open(char *path, int flags, mode_t mode, struct openfile **ret)
+{
+	struct openfile *of;
+	struct vnode *vn;
+	int result;
+
+	if ((flags & O_ACCMODE) == O_ACCMODE) {
+		return EINVAL;
+	}
+
+	result = vfs_open(path, flags, mode, &vn);
+	if (result) {
+		return result;
+	}
+	result = openfile_create(vn, flags & O_ACCMODE, &of);
+	if (result) {
+		vfs_close(vn);
+		return result;
+	}
+	of->of_append = (flags & O_APPEND) != 0;
+
+	*ret = of;
+	return 0;
+}
+
+void
+openfile_incref(struct openfile *of)
+{
+	spinlock_acquire(&of->of_reflock);
+	of->of_refcount++;
+	spinlock_release(&of->of_reflock);
+}
+
+void
+openfile_decref(struct openfile *of)
+{
+	bool last;
+
+	spinlock_acquire(&of->of_reflock);
+	KASSERT(of->of_refcount > 0);
+	of->of_refcount--;
+	last = (of->of_refcount == 0);
+	spinlock_release(&of->of_reflock);
+
+	if (!last) {
+		return;
+	}
+	vfs_close(of->of_vnode);
+	lock_destroy(of->of_lock);
+	spinlock_cleanup(&of->of_reflock);
+	kmem_cache_free(&openfile_cache, of);
+}
+
+bool
+openfile_readable(struct openfile *of)
+{
+	return of->of_accmode != O_WRONLY;
+}
+
+bool
+openfile_writable(struct openfile *of)
+{
+	return of->of_accmode != O_RDONLY;
+}
+
+struct filetable *
+filetable_create(void)
+{
+	struct filetable *ft;
+	unsigned i;
+
+	ft = kmalloc(sizeof(struct filetable));
+	if (ft == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < OPEN_MAX; i++) {
+		ft->ft_files[i] = NULL;
+	}
+	return ft;
+}
+
+/*
+ * Open "con:" once for each of stdin, stdout and stderr, so they have
+ * separate access modes like they would after a shell's redirections.
+ */
+int
+filetable_openconsole(struct filetable *ft)
+{
+	static const int modes[3] = { O_RDONLY, O_WRONLY, O_WRONLY };
+	struct openfile *of;
+	char path[5];
+	int fd, result;
+
+	for (fd = 0; fd < 3; fd++) {
+		KASSERT(ft->ft_files[fd] == NULL);
+
+		/* vfs_open may scribble on the path */
+		strcpy(path, "con:");
+		result = openfile_open(path, modes[fd], 0, &of);
+		if (result) {
+			return result;
+		}
+		ft->ft_files[fd] = of;
+	}
+	return 0;
+}
+
+void
+filetable_destroy(struct filetable *ft)
+{
+	unsigned i;
+
+	for (i = 0; i < OPEN_MAX; i++) {
+		if (ft->ft_files[i] != NULL) {
+			openfile_decref(ft->ft_files[i]);
+		}
+	}
+	kfree(ft);
+}
+
+int
+filetable_copy(struct filetable *ft, struct filetable **ret)
+{
+	struct filetable *new;
+	unsigned i;
+
+	new = filetable_create();
+	if (new == NULL) {
+		return ENOMEM;
+	}
+	for (i = 0; i < OPEN_MAX; i++) {
+		if (ft->ft_files[i] != NULL) {
+			openfile_incref(ft->ft_files[i]);
+			new->ft_files[i] = ft->ft_files[i];
+		}
+	}
+	*ret = new;
+	return 0;
+}
+
+int
+filetable_add(struct filetable *ft, struct openfile *of, int *fd)
+{
+	unsigned i;
+
+	for (i = 0; i < OPEN_MAX; i++) {
+		if (ft->ft_files[i] == NULL) {
+			ft->ft_files[i] = of;
+			*fd = i;
+			return 0;
+		}
+	}
+	return EMFILE;
+}
+
+/*
+ * Closing whatever was on NEWFD comes last, so that if it was the
+ * last reference to its file, nothing is left half done should
+ * closing it block.
+ */
+int
+filetable_dup2(struct filetable *ft, int oldfd, int newfd)
+{
+	struct openfile *old;
+
+	if (oldfd < 0 || oldfd >= OPEN_MAX || ft->ft_files[oldfd] == NULL) {
+		return EBADF;
+	}
+	if (newfd < 0 || newfd >= OPEN_MAX) {
+		return EBADF;
+	}
+	if (oldfd == newfd) {
+		return 0;
+	}
+	openfile_incref(ft->ft_files[oldfd]);
+	old = ft->ft_files[newfd];
+	ft->ft_files[newfd] = ft->ft_files[oldfd];
+	if (old != NULL) {
+		openfile_decref(old);
+	}
+	return 0;
+}
+
+int
+filetable_get(struct filetable *ft, int fd, struct openfile **ret)
+{
+	if (fd < 0 || fd >= OPEN_MAX || ft->ft_files[fd] == NULL) {
+		return EBADF;
+	}
+	*ret = ft->ft_files[fd];
+	return 0;
+}
+
+int
+filetable_close(struct filetable *ft, int fd)
+{
+	struct openfile *of;
+
+	if (fd < 0 || fd >= OPEN_MAX || ft->ft_files[fd] == NULL) {
+		return EBADF;
+	}
+	of = ft->ft_files[fd];
+	ft->ft_files[fd] = NULL;
+	openfile_decref(of);
+	return 0;
+}
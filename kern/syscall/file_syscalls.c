@@ -1,60 +1,463 @@
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/seek.h>
+#include <kern/stat.h>
 #include <kern/unistd.h>
 #include <lib.h>
+#include <limits.h>
 #include <uio.h>
+#include <copyinout.h>
 #include <syscall.h>
 #include <vnode.h>
 #include <vfs.h>
+#include <vm.h>
 #include <current.h>
 #include <proc.h>
+#include <synch.h>
+#include <file.h>
+#include <pipe.h>
 
-/* handler for write() system call                  */
 /*
- * n.b.
- * This implementation handles only writes to standard output 
- * and standard error, both of which go to the console.
- * Also, it does not provide any synchronization, so writes
- * are not atomic.
- *
- * You will need to improve this implementation
+ * File syscalls. Descriptors index curproc->p_files; see file.h.
+ * Reads and writes that use the seek position hold the open file's
+ * lock, so processes sharing it after fork see each transfer as a
+ * whole.
  */
 
+/* handler for open() system call                   */
+
 int
-sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
+sys_open(userptr_t upath, int flags, mode_t mode, int *retval)
 {
-  struct iovec iov;
-  struct uio u;
+  struct openfile *of;
+  char *path;
+  int result, fd;
+
+  path = kmalloc(PATH_MAX);
+  if (path == NULL) {
+    return ENOMEM;
+  }
+  result = copyinstr(upath, path, PATH_MAX, NULL);
+  if (result) {
+    kfree(path);
+    return result;
+  }
+
+  DEBUG(DB_SYSCALL,"Syscall: open(%s,%d)\n",path,flags);
+
+  result = openfile_open(path, flags, mode, &of);
+  kfree(path);
+  if (result) {
+    return result;
+  }
+  result = filetable_add(curproc->p_files, of, &fd);
+  if (result) {
+    openfile_decref(of);
+    return result;
+  }
+  *retval = fd;
+  return 0;
+}
+
+/* handler for close() system call                  */
+
+int
+sys_close(int fdesc)
+{
+  DEBUG(DB_SYSCALL,"Syscall: close(%d)\n",fdesc);
+
+  return filetable_close(curproc->p_files, fdesc);
+}
+
+/* handler for pipe() system call                  */
+
+int
+sys_pipe(userptr_t ufds)
+{
+  struct vnode *readvn, *writevn;
+  struct openfile *readof, *writeof;
+  int fds[2];
+  int result;
+
+  DEBUG(DB_SYSCALL,"Syscall: pipe(%x)\n",(unsigned int)ufds);
+
+  result = pipe_create(&readvn, &writevn);
+  if (result) {
+    return result;
+  }
+  result = openfile_create(readvn, O_RDONLY, &readof);
+  if (result) {
+    vfs_close(readvn);
+    vfs_close(writevn);
+    return result;
+  }
+  result = openfile_create(writevn, O_WRONLY, &writeof);
+  if (result) {
+    openfile_decref(readof);
+    vfs_close(writevn);
+    return result;
+  }
+
+  result = filetable_add(curproc->p_files, readof, &fds[0]);
+  if (result) {
+    openfile_decref(readof);
+    openfile_decref(writeof);
+    return result;
+  }
+  result = filetable_add(curproc->p_files, writeof, &fds[1]);
+  if (result) {
+    filetable_close(curproc->p_files, fds[0]);
+    openfile_decref(writeof);
+    return result;
+  }
+
+  result = copyout(fds, ufds, sizeof(fds));
+  if (result) {
+    filetable_close(curproc->p_files, fds[0]);
+    filetable_close(curproc->p_files, fds[1]);
+    return result;
+  }
+  return 0;
+}
+
+/* handler for dup2() system call                   */
+
+int
+sys_dup2(int oldfd, int newfd, int *retval)
+{
+  int result;
+
+  DEBUG(DB_SYSCALL,"Syscall: dup2(%d,%d)\n",oldfd,newfd);
+
+  result = filetable_dup2(curproc->p_files, oldfd, newfd);
+  if (result) {
+    return result;
+  }
+  *retval = newfd;
+  return 0;
+}
+
+/* readv/writev take up to this many iovecs without a kmalloc */
+#define FILE_NSTACKIOV 8
+
+/* the most readv/writev can move, so the count fits in the return value */
+#define FILE_MAXRESID  ((size_t)0x7fffffff)
+
+/* set up U to move RESID bytes through the user buffers in IOV */
+static
+void
+file_uinit(struct uio *u, struct iovec *iov, unsigned iovcnt, size_t resid,
+           enum uio_rw rw)
+{
+  u->uio_iov = iov;
+  u->uio_iovcnt = iovcnt;
+  u->uio_offset = 0;
+  u->uio_resid = resid;
+  u->uio_segflg = UIO_USERSPACE;
+  u->uio_rw = rw;
+  u->uio_space = curproc->p_addrspace;
+}
+
+/*
+ * Write U to VN at its offset, keeping any pages of the file cached
+ * for shared mappings in step. Whatever was written is accounted for
+ * even if the write fails part way.
+ */
+static
+int
+file_write(struct vnode *vn, struct uio *u)
+{
+#if OPT_A3
+  off_t start;
   int res;
 
-  DEBUG(DB_SYSCALL,"Syscall: write(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
-  
-  /* only stdout and stderr writes are currently implemented */
-  if (!((fdesc==STDOUT_FILENO)||(fdesc==STDERR_FILENO))) {
-    return EUNIMP;
+  start = u->uio_offset;
+  res = vm_prewrite(vn, start, start + u->uio_resid);
+  if (res) {
+    return res;
   }
-  KASSERT(curproc != NULL);
-  KASSERT(curproc->console != NULL);
-  KASSERT(curproc->p_addrspace != NULL);
+  res = VOP_WRITE(vn, u);
+  vm_postwrite(vn, start, u->uio_offset);
+  return res;
+#else
+  return VOP_WRITE(vn, u);
+#endif
+}
+
+/*
+ * Do the transfer U describes on FDESC. If POS is NULL it happens at
+ * the seek position, which is advanced by however much was moved,
+ * all under the open file's lock. Otherwise it happens at *POS and
+ * the seek position is neither used nor changed, so no lock is
+ * taken and positional I/O on a shared file doesn't serialize.
+ */
+static
+int
+file_io(int fdesc, struct uio *u, const off_t *pos, int *retval)
+{
+  struct openfile *of;
+  struct stat st;
+  size_t nbytes;
+  int res;
+
+  res = filetable_get(curproc->p_files, fdesc, &of);
+  if (res) {
+    return res;
+  }
+  if (u->uio_rw == UIO_READ ? !openfile_readable(of) : !openfile_writable(of)) {
+    return EBADF;
+  }
+  nbytes = u->uio_resid;
+
+  if (pos != NULL) {
+    if (*pos < 0) {
+      return EINVAL;
+    }
+    /* ESPIPE for the console and other things that can't seek */
+    res = VOP_TRYSEEK(of->of_vnode, *pos);
+    if (res) {
+      return res;
+    }
+    u->uio_offset = *pos;
+    if (u->uio_rw == UIO_READ) {
+      res = VOP_READ(of->of_vnode, u);
+    }
+    else {
+      res = file_write(of->of_vnode, u);
+    }
+  }
+  else {
+    lock_acquire(of->of_lock);
+    if (u->uio_rw == UIO_WRITE && of->of_append) {
+      res = VOP_STAT(of->of_vnode, &st);
+      if (res) {
+        lock_release(of->of_lock);
+        return res;
+      }
+      of->of_offset = st.st_size;
+    }
+    u->uio_offset = of->of_offset;
+    if (u->uio_rw == UIO_READ) {
+      res = VOP_READ(of->of_vnode, u);
+    }
+    else {
+      res = file_write(of->of_vnode, u);
+    }
+    if (res == 0) {
+      of->of_offset = u->uio_offset;
+    }
+    lock_release(of->of_lock);
+  }
+  if (res) {
+    return res;
+  }
+
+  /* pass back the number of bytes actually transferred */
+  *retval = nbytes - u->uio_resid;
+  KASSERT(*retval >= 0);
+  return 0;
+}
+
+/* read(), write(), pread() and pwrite(): one user buffer */
+static
+int
+file_rw(int fdesc, userptr_t ubuf, size_t nbytes, const off_t *pos,
+        enum uio_rw rw, int *retval)
+{
+  struct iovec iov;
+  struct uio u;
 
   /* set up a uio structure to refer to the user program's buffer (ubuf) */
   iov.iov_ubase = ubuf;
   iov.iov_len = nbytes;
-  u.uio_iov = &iov;
-  u.uio_iovcnt = 1;
-  u.uio_offset = 0;  /* not needed for the console */
-  u.uio_resid = nbytes;
-  u.uio_segflg = UIO_USERSPACE;
-  u.uio_rw = UIO_WRITE;
-  u.uio_space = curproc->p_addrspace;
-
-  res = VOP_WRITE(curproc->console,&u);
+  file_uinit(&u, &iov, 1, nbytes, rw);
+  return file_io(fdesc, &u, pos, retval);
+}
+
+/*
+ * readv() and writev(): IOVCNT user buffers, described by an array of
+ * iovecs in user memory, in one transfer.
+ */
+static
+int
+file_rwv(int fdesc, userptr_t uiov, int iovcnt, enum uio_rw rw, int *retval)
+{
+  struct iovec stackiov[FILE_NSTACKIOV], *iov;
+  struct uio u;
+  size_t total;
+  int i, res;
+
+  if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+    return EINVAL;
+  }
+  if (iovcnt <= FILE_NSTACKIOV) {
+    iov = stackiov;
+  }
+  else {
+    iov = kmalloc(iovcnt * sizeof(struct iovec));
+    if (iov == NULL) {
+      return ENOMEM;
+    }
+  }
+
+  res = copyin(uiov, iov, iovcnt * sizeof(struct iovec));
+  if (res) {
+    goto out;
+  }
+  total = 0;
+  for (i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len > FILE_MAXRESID - total) {
+      res = EINVAL;
+      goto out;
+    }
+    total += iov[i].iov_len;
+  }
+
+  file_uinit(&u, iov, iovcnt, total, rw);
+  res = file_io(fdesc, &u, NULL, retval);
+
+ out:
+  if (iov != stackiov) {
+    kfree(iov);
+  }
+  return res;
+}
+
+/* handler for read() system call                   */
+
+int
+sys_read(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: read(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
+
+  return file_rw(fdesc, ubuf, nbytes, NULL, UIO_READ, retval);
+}
+
+/* handler for write() system call                  */
+
+int
+sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: write(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
+
+  return file_rw(fdesc, ubuf, nbytes, NULL, UIO_WRITE, retval);
+}
+
+/* handler for pread() system call                  */
+
+int
+sys_pread(int fdesc, userptr_t ubuf, size_t nbytes, off_t pos, int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: pread(%d,%x,%d,%d)\n",fdesc,(unsigned int)ubuf,
+        nbytes,(int)pos);
+
+  return file_rw(fdesc, ubuf, nbytes, &pos, UIO_READ, retval);
+}
+
+/* handler for pwrite() system call                 */
+
+int
+sys_pwrite(int fdesc, userptr_t ubuf, size_t nbytes, off_t pos, int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: pwrite(%d,%x,%d,%d)\n",fdesc,(unsigned int)ubuf,
+        nbytes,(int)pos);
+
+  return file_rw(fdesc, ubuf, nbytes, &pos, UIO_WRITE, retval);
+}
+
+/* handler for readv() system call                  */
+
+int
+sys_readv(int fdesc, userptr_t iov, int iovcnt, int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: readv(%d,%x,%d)\n",fdesc,(unsigned int)iov,iovcnt);
+
+  return file_rwv(fdesc, iov, iovcnt, UIO_READ, retval);
+}
+
+/* handler for writev() system call                 */
+
+int
+sys_writev(int fdesc, userptr_t iov, int iovcnt, int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: writev(%d,%x,%d)\n",fdesc,(unsigned int)iov,iovcnt);
+
+  return file_rwv(fdesc, iov, iovcnt, UIO_WRITE, retval);
+}
+
+/* handler for lseek() system call                  */
+
+int
+sys_lseek(int fdesc, off_t pos, int whence, off_t *retval)
+{
+  struct openfile *of;
+  struct stat st;
+  off_t newpos;
+  int res;
+
+  DEBUG(DB_SYSCALL,"Syscall: lseek(%d,%d,%d)\n",fdesc,(int)pos,whence);
+
+  res = filetable_get(curproc->p_files, fdesc, &of);
   if (res) {
     return res;
   }
 
-  /* pass back the number of bytes actually written */
-  *retval = nbytes - u.uio_resid;
-  KASSERT(*retval >= 0);
-  return 0;
+  newpos = 0;
+  lock_acquire(of->of_lock);
+  switch (whence) {
+  case SEEK_SET:
+    newpos = pos;
+    break;
+  case SEEK_CUR:
+    newpos = of->of_offset + pos;
+    break;
+  case SEEK_END:
+    res = VOP_STAT(of->of_vnode, &st);
+    newpos = st.st_size + pos;
+    break;
+  default:
+    res = EINVAL;
+    break;
+  }
+  if (res == 0 && newpos < 0) {
+    res = EINVAL;
+  }
+  if (res == 0) {
+    /* ESPIPE for the console and other things that can't seek */
+    res = VOP_TRYSEEK(of->of_vnode, newpos);
+  }
+  if (res == 0) {
+    of->of_offset = newpos;
+    *retval = newpos;
+  }
+  lock_release(of->of_lock);
+  return res;
+}
+
+/* handler for fsync() system call                  */
+/*
+ * Pages of the file dirtied through shared mappings are written back
+ * first, so they reach the disk too.
+ */
+
+int
+sys_fsync(int fdesc)
+{
+  struct openfile *of;
+  int res;
+
+  DEBUG(DB_SYSCALL,"Syscall: fsync(%d)\n",fdesc);
+
+  res = filetable_get(curproc->p_files, fdesc, &of);
+  if (res) {
+    return res;
+  }
+#if OPT_A3
+  res = vm_fsync(of->of_vnode);
+  if (res) {
+    return res;
+  }
+#endif
+  return VOP_FSYNC(of->of_vnode);
 }
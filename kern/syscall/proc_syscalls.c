@@ -3,7 +3,10 @@
 #include <kern/unistd.h>
 #include <kern/wait.h>
 #include <kern/fcntl.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <lib.h>
+#include <clock.h>
 #include <syscall.h>
 #include <current.h>
 #include <proc.h>
@@ -14,8 +17,21 @@
 #include <mips/trapframe.h>
 #include <vfs.h>
 #include <vm.h>
+#include <file.h>
 #include "opt-A2.h"
 
+#if OPT_A2
+/* add FROM into TO */
+static void
+usage_add(struct procusage *to, const struct procusage *from)
+{
+  to->pu_uticks += from->pu_uticks;
+  to->pu_kticks += from->pu_kticks;
+  to->pu_nvcsw += from->pu_nvcsw;
+  to->pu_nivcsw += from->pu_nivcsw;
+}
+#endif
+
   /* this implementation of sys__exit does not do anything with the exit code */
   /* this needs to be fixed to get exit() and waitpid() working properly */
 
@@ -41,6 +57,10 @@ void sys__exit(int exitcode) {
   as = curproc_setas(NULL);
   as_destroy(as);
 
+  /* close our files now rather than when the parent reaps us */
+  filetable_destroy(p->p_files);
+  p->p_files = NULL;
+
   /* detach this thread from its process */
   /* note: curproc cannot be used after this call */
   proc_remthread(curthread);
@@ -54,6 +74,16 @@ void sys__exit(int exitcode) {
      will wake up the kernel menu thread */
     proc_destroy(p);
   } else { /*has living parent. move to dead children array*/
+    //charge our cpu usage, and our children's, to the parent before it
+    //can see that we exited
+    struct procusage pu, cpu;
+    proc_getusage(p, false, &pu);
+    proc_getusage(p, true, &cpu);
+    spinlock_acquire(&parent->p_lock);
+    usage_add(&parent->p_cusage, &pu);
+    usage_add(&parent->p_cusage, &cpu);
+    spinlock_release(&parent->p_lock);
+
     //set exited to true and save the exit_code
     lock_acquire(p->set_lock);
     p->exit_code = exitcode;
@@ -122,24 +152,19 @@ sys_waitpid(pid_t pid,
   }
   
   #if OPT_A2
-  //search through living_children array
-  struct proc* living_child = look_through_children(curproc->p_living_children,pid);
-  //search through dead_children array
-  struct proc* dead_child = look_through_children(curproc->p_dead_children, pid);
-
-  //if the child is dead fetch exit code
-  if(dead_child != NULL){
-    exitstatus = _MKWAIT_EXIT(dead_child->exit_code);
-  }else if (living_child != NULL) { //if child is living, go to block
-    lock_acquire(living_child->wait_lock);
-    while(living_child->exited == 0) {
-      cv_wait(living_child->wait_cv, living_child->wait_lock);
+  //look the child up in the process table; it may have exited already
+  struct proc* child = proc_getchild(curproc, pid);
+
+  if (child != NULL) { //block until it has exited, then fetch exit code
+    lock_acquire(child->wait_lock);
+    while(child->exited == 0) {
+      cv_wait(child->wait_cv, child->wait_lock);
     }
-    lock_release(living_child->wait_lock);
-    exitstatus = _MKWAIT_EXIT(living_child->exit_code);
-  }else{ //if not one of curproc children return -1
+    lock_release(child->wait_lock);
+    exitstatus = _MKWAIT_EXIT(child->exit_code);
+  }else{ //not one of curproc's children: no such process, or someone else's
     *retval = -1;
-    return(EINVAL);
+    return(pid_exists(pid) ? ECHILD : ESRCH);
   }
 
   #else
@@ -155,6 +180,89 @@ sys_waitpid(pid_t pid,
   return(0);
 }
 
+/* hardclocks to a timeval */
+static void
+ticks_to_timeval(unsigned ticks, struct timeval *tv)
+{
+  tv->tv_sec = ticks / HZ;
+  tv->tv_usec = (ticks % HZ) * (1000000 / HZ);
+}
+
+/* handler for getrusage(): cpu time and context switches only */
+int
+sys_getrusage(int who, userptr_t usage)
+{
+  struct procusage pu;
+  struct rusage ru;
+
+  if (who != RUSAGE_SELF && who != RUSAGE_CHILDREN) {
+    return EINVAL;
+  }
+  proc_getusage(curproc, who == RUSAGE_CHILDREN, &pu);
+
+  bzero(&ru, sizeof(ru));
+  ticks_to_timeval(pu.pu_uticks, &ru.ru_utime);
+  ticks_to_timeval(pu.pu_kticks, &ru.ru_stime);
+  ru.ru_nvcsw = pu.pu_nvcsw;
+  ru.ru_nivcsw = pu.pu_nivcsw;
+  return copyout(&ru, usage, sizeof(ru));
+}
+
+/*
+ * handler for setaffinity(): restrict every thread of a process (the
+ * caller if PID is 0, or one of its children) to the cpus in MASK
+ */
+int
+sys_setaffinity(pid_t pid, uint32_t mask)
+{
+  struct proc *p;
+  struct thread *t;
+  uint32_t kick;
+  unsigned i;
+  int result;
+
+  if (pid == 0) {
+    p = curproc;
+  }
+#if OPT_A2
+  else if (pid == curproc->pid) {
+    p = curproc;
+  }
+  else {
+    p = proc_getchild(curproc, pid);
+    if (p == NULL || p->exited) {
+      return ESRCH;
+    }
+  }
+#else
+  else {
+    return ESRCH;
+  }
+#endif
+
+  //p_lock keeps the threads from exiting under us
+  result = 0;
+  kick = 0;
+  spinlock_acquire(&p->p_lock);
+  for (i = 0; i < threadarray_num(&p->p_threads) && result == 0; i++) {
+    t = threadarray_get(&p->p_threads, i);
+    if (t != curthread) {
+      result = thread_setaffinity_other(t, mask, &kick);
+    }
+  }
+  spinlock_release(&p->p_lock);
+
+  //these fork threads and may move us, so they can't be done holding p_lock
+  if (result == 0 && kick != 0) {
+    //best effort: the threads still move when next they sleep or yield
+    (void)thread_kick(kick);
+  }
+  if (result == 0 && p == curproc) {
+    result = thread_setaffinity(mask);
+  }
+  return result;
+}
+
 pid_t
 sys_fork(struct trapframe *parent_tf, pid_t *retval) {
   KASSERT(curproc != NULL);
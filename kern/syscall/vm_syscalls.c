@@ -0,0 +1,117 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <copyinout.h>
+#include <syscall.h>
+#include <current.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <vnode.h>
+#include <file.h>
+
+/* handler for sbrk() system call                   */
+/*
+ * The heap is a region of its own that starts right after the
+ * program's data. Growing it only moves the break; pages are
+ * zero-filled on first touch, and pages given back by a shrink are
+ * freed immediately.
+ */
+
+int
+sys_sbrk(intptr_t amount, vaddr_t *retval)
+{
+  struct addrspace *as;
+
+  DEBUG(DB_SYSCALL,"Syscall: sbrk(%d)\n",(int)amount);
+
+  as = curproc_getas();
+  if (as == NULL) {
+    return ENOMEM;
+  }
+  return as_sbrk(as, amount, retval);
+}
+
+/*
+ * Find the vnode open on FD, checking that the file was opened for
+ * reading, and for writing too if the mapping writes back to it.
+ */
+static
+int
+mmap_getvnode(int fd, int prot, int flags, struct vnode **vn)
+{
+  struct openfile *of;
+  int result;
+
+  result = filetable_get(curproc->p_files, fd, &of);
+  if (result) {
+    return result;
+  }
+  if (!openfile_readable(of)) {
+    return EACCES;
+  }
+  if (flags == MAP_SHARED && (prot & PROT_WRITE) && !openfile_writable(of)) {
+    return EACCES;
+  }
+  *vn = of->of_vnode;
+  return 0;
+}
+
+/* handler for mmap() system call                   */
+/*
+ * mmap takes six arguments; the fifth (fd) and sixth (a 64-bit
+ * offset, aligned to 8 bytes) are on the user stack, past the four
+ * slots reserved for the register arguments. The address hint is
+ * ignored: the kernel always picks the address.
+ */
+
+int
+sys_mmap(vaddr_t addr, size_t len, int prot, int flags, userptr_t stackargs,
+         vaddr_t *retval)
+{
+  struct addrspace *as;
+  struct vnode *vn;
+  off_t offset;
+  int fd, result;
+
+  (void)addr;
+
+  result = copyin(stackargs, &fd, sizeof(fd));
+  if (result) {
+    return result;
+  }
+  result = copyin(stackargs + 8, &offset, sizeof(offset));
+  if (result) {
+    return result;
+  }
+
+  DEBUG(DB_SYSCALL,"Syscall: mmap(%u,%d,%d,%d)\n",len,prot,flags,fd);
+
+  as = curproc_getas();
+  if (as == NULL) {
+    return ENOMEM;
+  }
+
+  result = mmap_getvnode(fd, prot, flags, &vn);
+  if (result) {
+    return result;
+  }
+  return as_mmap(as, vn, len, prot, flags, offset, retval);
+}
+
+/* handler for munmap() system call                 */
+
+int
+sys_munmap(vaddr_t addr, size_t len)
+{
+  struct addrspace *as;
+
+  DEBUG(DB_SYSCALL,"Syscall: munmap(0x%x,%u)\n",addr,len);
+
+  as = curproc_getas();
+  if (as == NULL) {
+    return EINVAL;
+  }
+  return as_munmap(as, addr, len);
+}
@@ -347,3 +347,272 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Lock throughput benchmark.
+ *
+ * NBENCHTHREADS threads each take and drop a mutex NBENCHLOOPS times,
+ * doing a little work while holding it and a little more between
+ * tries. It is run once with a lock and once with a binary semaphore,
+ * which always goes to sleep if it can't get in at once, so the
+ * difference is what lock_acquire's spinning buys. It only shows
+ * with more than one cpu; on one, the two should come out even.
+ */
+
+#define NBENCHTHREADS 8
+#define NBENCHLOOPS   2000
+#define BENCHWORK     50	/* busy-loop iterations in and out of the lock */
+
+static struct lock *benchlock;
+static struct semaphore *benchsem;
+static struct semaphore *benchdone;
+static volatile unsigned long benchcount;
+
+static
+void
+benchwork(void)
+{
+	volatile int j;
+
+	for (j=0; j<BENCHWORK; j++);
+}
+
+static
+void
+lockbenchthread(void *usesem, unsigned long num)
+{
+	int i;
+
+	(void)num;
+
+	for (i=0; i<NBENCHLOOPS; i++) {
+		if (usesem) {
+			P(benchsem);
+		}
+		else {
+			lock_acquire(benchlock);
+		}
+		benchcount++;
+		benchwork();
+		if (usesem) {
+			V(benchsem);
+		}
+		else {
+			lock_release(benchlock);
+		}
+		benchwork();
+	}
+	V(benchdone);
+#ifdef UW
+  thread_exit();
+#endif
+}
+
+static
+void
+lockbenchrun(const char *what, void *usesem)
+{
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	unsigned long total;
+	unsigned ms;
+	int i, result;
+
+	benchcount = 0;
+	total = (unsigned long)NBENCHTHREADS * NBENCHLOOPS;
+
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<NBENCHTHREADS; i++) {
+		result = thread_fork("lockbench", NULL, lockbenchthread,
+				     usesem, i);
+		if (result) {
+			panic("lockbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NBENCHTHREADS; i++) {
+		P(benchdone);
+	}
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+
+	if (benchcount != total) {
+		kprintf("%s: count is %lu, should be %lu\n", what,
+			benchcount, total);
+		kprintf("Test failed\n");
+	}
+
+	ms = secs * 1000 + nsecs / 1000000;
+	kprintf("%-10s %lu acquisitions in %u.%03u s: %lu/s\n", what, total,
+		ms / 1000, ms % 1000, ms ? total * 1000 / ms : 0);
+}
+
+int
+lockbench(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	benchlock = lock_create("benchlock");
+	benchsem = sem_create("benchsem", 1);
+	benchdone = sem_create("benchdone", 0);
+	if (benchlock == NULL || benchsem == NULL || benchdone == NULL) {
+		panic("lockbench: out of memory\n");
+	}
+
+	kprintf("Starting lock benchmark: %d threads, %d loops each...\n",
+		NBENCHTHREADS, NBENCHLOOPS);
+	lockbenchrun("lock", NULL);
+	lockbenchrun("semaphore", benchsem);
+
+	lock_destroy(benchlock);
+	sem_destroy(benchsem);
+	sem_destroy(benchdone);
+	kprintf("Lock benchmark done.\n");
+	return 0;
+}
+
+/*
+ * Reader-writer lock stress test.
+ *
+ * NRWTHREADS threads hammer one rwlock, each writing on every
+ * RWWRITEEVERY'th pass and reading otherwise. Writers set all the
+ * words of rwtestdata to a new value, yielding partway through;
+ * readers check the words all match. Both check who else is inside:
+ * no one else with a writer, and no writer with a reader. The
+ * largest number of readers seen inside at once is reported, since a
+ * lock that never lets two readers in would pass everything else.
+ */
+
+#define NRWTHREADS    16
+#define NRWLOOPS      200
+#define RWWRITEEVERY  8
+#define NRWDATA       8
+
+static struct rwlock *testrw;
+static struct semaphore *rwdone;
+static struct spinlock rwcount_lock = SPINLOCK_INITIALIZER;
+static volatile unsigned long rwtestdata[NRWDATA];
+static unsigned rwreaders, rwwriters, rwmaxreaders, rwfailures;
+
+static
+void
+rwfail(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: %s\n", num, msg);
+	spinlock_acquire(&rwcount_lock);
+	rwfailures++;
+	spinlock_release(&rwcount_lock);
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	unsigned long val;
+	int i, j;
+	bool writing;
+
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		writing = (i + num) % RWWRITEEVERY == 0;
+		if (writing) {
+			rwlock_acquire_write(testrw);
+		}
+		else {
+			rwlock_acquire_read(testrw);
+		}
+
+		spinlock_acquire(&rwcount_lock);
+		if (writing) {
+			rwwriters++;
+		}
+		else {
+			rwreaders++;
+			if (rwreaders > rwmaxreaders) {
+				rwmaxreaders = rwreaders;
+			}
+		}
+		spinlock_release(&rwcount_lock);
+
+		if (writing) {
+			val = num * NRWLOOPS + i;
+			for (j=0; j<NRWDATA; j++) {
+				rwtestdata[j] = val;
+				if (j == NRWDATA / 2) {
+					thread_yield();
+				}
+			}
+			if (rwwriters != 1 || rwreaders != 0) {
+				rwfail(num, "writer not alone");
+			}
+		}
+		else {
+			val = rwtestdata[0];
+			thread_yield();
+			for (j=1; j<NRWDATA; j++) {
+				if (rwtestdata[j] != val) {
+					rwfail(num, "reader saw a torn write");
+					break;
+				}
+			}
+			if (rwwriters != 0) {
+				rwfail(num, "reader inside with a writer");
+			}
+		}
+
+		spinlock_acquire(&rwcount_lock);
+		if (writing) {
+			rwwriters--;
+		}
+		else {
+			rwreaders--;
+		}
+		spinlock_release(&rwcount_lock);
+
+		rwlock_release(testrw);
+	}
+	V(rwdone);
+#ifdef UW
+  thread_exit();
+#endif
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	testrw = rwlock_create("testrw");
+	rwdone = sem_create("rwdone", 0);
+	if (testrw == NULL || rwdone == NULL) {
+		panic("rwtest: out of memory\n");
+	}
+	rwreaders = rwwriters = rwmaxreaders = rwfailures = 0;
+
+	kprintf("Starting rwlock test...\n");
+	for (i=0; i<NRWTHREADS; i++) {
+		result = thread_fork("rwtest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NRWTHREADS; i++) {
+		P(rwdone);
+	}
+
+	kprintf("Up to %u readers held the lock at once.\n", rwmaxreaders);
+	if (rwfailures > 0 || rwmaxreaders < 2) {
+		kprintf("Test failed\n");
+	}
+
+	rwlock_destroy(testrw);
+	sem_destroy(rwdone);
+	kprintf("Rwlock test done.\n");
+	return 0;
+}
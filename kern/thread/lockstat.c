@@ -0,0 +1,346 @@
+/*
+ * Lock contention statistics, built with "options lockstat". See
+ * lockstat.h.
+ *
+ * Counters live in a fixed table, keyed by name for sleep locks and
+ * CVs and by acquiring call site for spinlocks. Each lock remembers
+ * which entry its current acquisition was charged to, so the release
+ * can charge the hold time to the same place.
+ *
+ * The table is protected by a bare spinlock word rather than a struct
+ * spinlock, because spinlock_acquire itself reports here.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <lockstat.h>
+
+#define LOCKSTAT_NENTRIES 512	/* distinct locks tracked */
+#define LOCKSTAT_NAMELEN  24	/* names are truncated to fit */
+
+enum lockstat_kind {
+	LS_UNUSED,
+	LS_SPINLOCK,
+	LS_LOCK,
+	LS_CV,
+};
+
+struct lockstat {
+	enum lockstat_kind ls_kind;
+	const void *ls_site;		/* spinlocks: where acquired */
+	char ls_name[LOCKSTAT_NAMELEN];	/* locks and cvs: the name */
+	unsigned ls_acquires;		/* for cvs, waits */
+	unsigned ls_contended;		/* acquisitions that had to wait */
+	uint64_t ls_waitns;		/* total time spent waiting */
+	uint64_t ls_maxholdns;		/* longest single hold */
+};
+
+static volatile spinlock_data_t lockstat_word = SPINLOCK_DATA_INITIALIZER;
+static struct lockstat lockstats[LOCKSTAT_NENTRIES];
+static struct lockstat lockstat_other;	/* when lockstats is full */
+static bool lockstat_enabled;
+
+void
+lockstat_bootstrap(void)
+{
+	lockstat_enabled = true;
+}
+
+uint64_t
+lockstat_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	if (!lockstat_enabled) {
+		return 0;
+	}
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+static
+int
+lockstat_enter(void)
+{
+	int spl;
+
+	spl = splhigh();
+	while (spinlock_data_get(&lockstat_word) != 0 ||
+	       spinlock_data_testandset(&lockstat_word) != 0) {
+		/* spin */
+	}
+	return spl;
+}
+
+static
+void
+lockstat_exit(int spl)
+{
+	spinlock_data_set(&lockstat_word, 0);
+	splx(spl);
+}
+
+/* Does NAME match STORED, which may be NAME cut short? */
+static
+bool
+lockstat_samename(const char *stored, const char *name)
+{
+	unsigned i;
+
+	for (i = 0; i < LOCKSTAT_NAMELEN - 1; i++) {
+		if (stored[i] != name[i]) {
+			return false;
+		}
+		if (name[i] == 0) {
+			break;
+		}
+	}
+	return true;
+}
+
+/*
+ * Find or claim the entry for a spinlock acquired at SITE, or a lock
+ * or cv called NAME. Open addressing; once the table fills up, new
+ * locks are lumped together in lockstat_other.
+ */
+static
+struct lockstat *
+lockstat_find(enum lockstat_kind kind, const char *name, const void *site)
+{
+	struct lockstat *ls;
+	unsigned hash, i, n;
+
+	if (kind == LS_SPINLOCK) {
+		hash = (uintptr_t)site >> 2;
+	}
+	else {
+		hash = kind;
+		for (i = 0; i < LOCKSTAT_NAMELEN - 1 && name[i] != 0; i++) {
+			hash = hash * 33 + (unsigned char)name[i];
+		}
+	}
+
+	i = hash % LOCKSTAT_NENTRIES;
+	for (n = 0; n < LOCKSTAT_NENTRIES; n++) {
+		ls = &lockstats[i];
+		if (ls->ls_kind == LS_UNUSED) {
+			ls->ls_kind = kind;
+			ls->ls_site = site;
+			if (name != NULL) {
+				snprintf(ls->ls_name, sizeof(ls->ls_name),
+					 "%s", name);
+			}
+			return ls;
+		}
+		if (ls->ls_kind == kind &&
+		    (kind == LS_SPINLOCK ? ls->ls_site == site :
+		     lockstat_samename(ls->ls_name, name))) {
+			return ls;
+		}
+		i = (i + 1) % LOCKSTAT_NENTRIES;
+	}
+	return &lockstat_other;
+}
+
+/* Charge an acquisition. Call with the table locked. */
+static
+void
+lockstat_count(struct lockstat *ls, bool contended, uint64_t waitns)
+{
+	ls->ls_acquires++;
+	if (contended) {
+		ls->ls_contended++;
+		ls->ls_waitns += waitns;
+	}
+}
+
+/* Charge a hold time. Call with the table locked. */
+static
+void
+lockstat_hold(struct lockstat *ls, uint64_t holdns)
+{
+	if (holdns > ls->ls_maxholdns) {
+		ls->ls_maxholdns = holdns;
+	}
+}
+
+void
+lockstat_spinlock_acquired(struct spinlock *lk, bool contended,
+			   uint64_t start, const void *caller)
+{
+	struct lockstat *ls;
+	uint64_t now;
+	int spl;
+
+	if (start == 0) {
+		lk->lk_stat = NULL;
+		return;
+	}
+
+	now = lockstat_now();
+	spl = lockstat_enter();
+	ls = lockstat_find(LS_SPINLOCK, NULL, caller);
+	lockstat_count(ls, contended, now - start);
+	lockstat_exit(spl);
+
+	lk->lk_stat = ls;
+	lk->lk_acquired = now;
+}
+
+void
+lockstat_spinlock_released(struct spinlock *lk)
+{
+	uint64_t holdns;
+	int spl;
+
+	if (lk->lk_stat == NULL) {
+		return;
+	}
+
+	holdns = lockstat_now() - lk->lk_acquired;
+	spl = lockstat_enter();
+	lockstat_hold(lk->lk_stat, holdns);
+	lockstat_exit(spl);
+	lk->lk_stat = NULL;
+}
+
+void
+lockstat_lock_acquired(struct lock *lock, bool contended, uint64_t start)
+{
+	uint64_t now;
+	int spl;
+
+	if (start == 0) {
+		lock->lk_acquired = 0;
+		return;
+	}
+
+	now = lockstat_now();
+	spl = lockstat_enter();
+	if (lock->lk_stat == NULL) {
+		lock->lk_stat = lockstat_find(LS_LOCK, lock->lk_name, NULL);
+	}
+	lockstat_count(lock->lk_stat, contended, now - start);
+	lockstat_exit(spl);
+
+	lock->lk_acquired = now;
+}
+
+void
+lockstat_lock_released(struct lock *lock)
+{
+	uint64_t holdns;
+	int spl;
+
+	if (lock->lk_acquired == 0) {
+		return;
+	}
+
+	holdns = lockstat_now() - lock->lk_acquired;
+	spl = lockstat_enter();
+	lockstat_hold(lock->lk_stat, holdns);
+	lockstat_exit(spl);
+	lock->lk_acquired = 0;
+}
+
+void
+lockstat_cv_waited(struct cv *cv, uint64_t start)
+{
+	uint64_t now;
+	int spl;
+
+	if (start == 0) {
+		return;
+	}
+
+	now = lockstat_now();
+	spl = lockstat_enter();
+	if (cv->cv_stat == NULL) {
+		cv->cv_stat = lockstat_find(LS_CV, cv->cv_name, NULL);
+	}
+	/* Every wait sleeps, so every wait is contended. */
+	lockstat_count(cv->cv_stat, true, now - start);
+	lockstat_exit(spl);
+}
+
+void
+lockstat_printstats(unsigned n)
+{
+	struct lockstat *top, *ls;
+	unsigned i, j, ntop;
+	char name[LOCKSTAT_NAMELEN + 16];
+	int spl;
+
+	if (n > LOCKSTAT_NENTRIES) {
+		n = LOCKSTAT_NENTRIES;
+	}
+	top = kmalloc(n * sizeof(struct lockstat));
+	if (top == NULL) {
+		kprintf("lockstat: Out of memory\n");
+		return;
+	}
+
+	/* Copy out the top N, so we print without the table locked. */
+	ntop = 0;
+	spl = lockstat_enter();
+	for (i = 0; i <= LOCKSTAT_NENTRIES; i++) {
+		ls = i < LOCKSTAT_NENTRIES ? &lockstats[i] : &lockstat_other;
+		if (ls->ls_acquires == 0) {
+			continue;
+		}
+		/* Insertion into a short sorted list. */
+		for (j = ntop; j > 0 && top[j-1].ls_waitns < ls->ls_waitns;
+		     j--) {
+			if (j < n) {
+				top[j] = top[j-1];
+			}
+		}
+		if (j < n) {
+			top[j] = *ls;
+			if (ntop < n) {
+				ntop++;
+			}
+		}
+	}
+	lockstat_exit(spl);
+
+	kprintf("Locks by total wait time:\n");
+	kprintf("  %-32s %9s %9s %9s %10s\n", "lock", "acquires",
+		"contended", "wait ms", "maxhold us");
+	for (i = 0; i < ntop; i++) {
+		ls = &top[i];
+		switch (ls->ls_kind) {
+		    case LS_SPINLOCK:
+			snprintf(name, sizeof(name), "spinlock at %p",
+				 ls->ls_site);
+			break;
+		    case LS_LOCK:
+			snprintf(name, sizeof(name), "lock %s", ls->ls_name);
+			break;
+		    case LS_CV:
+			snprintf(name, sizeof(name), "cv %s", ls->ls_name);
+			break;
+		    default:
+			snprintf(name, sizeof(name), "(other)");
+			break;
+		}
+		kprintf("  %-32s %9u %9u %9u %10u\n", name,
+			ls->ls_acquires, ls->ls_contended,
+			(unsigned)(ls->ls_waitns / 1000000),
+			(unsigned)(ls->ls_maxholdns / 1000));
+	}
+	if (!lockstat_enabled) {
+		kprintf("  (not recording yet)\n");
+	}
+	else {
+		kprintf("Use os161-addr2line on the kernel to name the "
+			"spinlock sites.\n");
+	}
+
+	kfree(top);
+}
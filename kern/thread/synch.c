@@ -38,7 +38,10 @@
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
+#include <cpu.h>
 #include <synch.h>
+#include <slab.h>
+#include <lockstat.h>
 
 ////////////////////////////////////////////////////////////
 //
@@ -147,19 +150,22 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+static struct kmem_cache lock_cache =
+	KMEM_CACHE_INITIALIZER("lock", sizeof(struct lock), NULL);
+
 struct lock *
 lock_create(const char *name)
 {
         struct lock *lock;
 
-        lock = kmalloc(sizeof(struct lock));
+        lock = kmem_cache_alloc(&lock_cache);
         if (lock == NULL) {
                 return NULL;
         }
 
         lock->lk_name = kstrdup(name);
         if (lock->lk_name == NULL) {
-                kfree(lock);
+                kmem_cache_free(&lock_cache, lock);
                 return NULL;
         }
         
@@ -168,13 +174,18 @@ lock_create(const char *name)
 	lock->lk_wchan = wchan_create(lock->lk_name);
 	if (lock->lk_wchan == NULL){
 		kfree(lock->lk_name);
-		kfree(lock);
+		kmem_cache_free(&lock_cache, lock);
 		return NULL;
 	}
 
 	spinlock_init(&lock->lk_lock);
 	lock->lk_owner = NULL;
+	lock->lk_ownercpu = NULL;
 	lock->held = false;
+#if OPT_LOCKSTAT
+	lock->lk_stat = NULL;
+	lock->lk_acquired = 0;
+#endif
 
         return lock;
 }
@@ -189,21 +200,64 @@ lock_destroy(struct lock *lock)
         spinlock_cleanup(&lock->lk_lock);
 
         kfree(lock->lk_name);
-        kfree(lock);
+        kmem_cache_free(&lock_cache, lock);
+}
+
+/*
+ * Is OWNER, which took a lock while on cpu C, still running there?
+ * Only C is looked at, never OWNER itself, which may already have
+ * exited and been freed. If OWNER has moved since it took the lock
+ * this says no, which just means the caller sleeps.
+ */
+static
+bool
+lock_owner_running(const volatile struct thread *owner, struct cpu *c)
+{
+	const volatile struct cpu *vc = c;
+
+	return c != NULL && vc->c_curthread == owner && !vc->c_isidle;
 }
 
 void
 lock_acquire(struct lock *lock)
 {
-        // Write this
+	const volatile struct thread *owner;
+	struct cpu *ownercpu;
+#if OPT_LOCKSTAT
+	uint64_t start;
+	bool contended = false;
+#endif
 	
 	KASSERT(lock != NULL);
         KASSERT(!lock_do_i_hold(lock));
         KASSERT(lock->lk_wchan != NULL);
 
+#if OPT_LOCKSTAT
+	start = lockstat_now();
+#endif
         spinlock_acquire(&lock->lk_lock);
 
         while(lock->held) {
+#if OPT_LOCKSTAT
+	    contended = true;
+#endif
+	    owner = lock->lk_owner;
+	    ownercpu = lock->lk_ownercpu;
+	    if (lock_owner_running(owner, ownercpu)) {
+		/*
+		 * The owner is busy on another cpu (it can't be
+		 * this one; we're running here). Wait for it to let
+		 * go or stop running, without the spinlock so it can
+		 * release.
+		 */
+		spinlock_release(&lock->lk_lock);
+		while (lock->held && lock->lk_owner == owner &&
+		       lock_owner_running(owner, ownercpu)) {
+			/* spin */
+		}
+		spinlock_acquire(&lock->lk_lock);
+		continue;
+	    }
             wchan_lock(lock->lk_wchan);
             spinlock_release(&lock->lk_lock);
             wchan_sleep(lock->lk_wchan);
@@ -211,10 +265,15 @@ lock_acquire(struct lock *lock)
         }
 
         lock->lk_owner = curthread;
+	lock->lk_ownercpu = curcpu->c_self;
 	lock->held = true;
 
         spinlock_release(&lock->lk_lock);
 
+#if OPT_LOCKSTAT
+	lockstat_lock_acquired(lock, contended, start);
+#endif
+
         //(void)lock;  // suppress warning until code gets written
 }
 
@@ -227,7 +286,11 @@ lock_release(struct lock *lock)
         spinlock_acquire(&lock->lk_lock);
 
         if(lock_do_i_hold(lock)) {
+#if OPT_LOCKSTAT
+	    lockstat_lock_released(lock);
+#endif
             lock->lk_owner = NULL;
+	    lock->lk_ownercpu = NULL;
 	    lock->held = false;
             wchan_wakeone(lock->lk_wchan);
         }
@@ -278,6 +341,9 @@ cv_create(const char *name)
             kfree(cv);
             return NULL;
         }
+#if OPT_LOCKSTAT
+	cv->cv_stat = NULL;
+#endif
 
         return cv;
 }
@@ -301,10 +367,16 @@ cv_wait(struct cv *cv, struct lock *lock)
         KASSERT(lock != NULL);
         KASSERT(lock_do_i_hold(lock));
 
+#if OPT_LOCKSTAT
+	uint64_t start = lockstat_now();
+#endif
         wchan_lock(cv->cv_wchan);
         lock_release(lock);
         wchan_sleep(cv->cv_wchan);
         lock_acquire(lock);
+#if OPT_LOCKSTAT
+	lockstat_cv_waited(cv, start);
+#endif
         // Write this
 	
         //(void)cv;    // suppress warning until code gets written
@@ -340,3 +412,137 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 	//(void)cv;    // suppress warning until code gets written
 	//(void)lock;  // suppress warning until code gets written
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(struct rwlock));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rw_name = kstrdup(name);
+	if (rw->rw_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_readwchan = wchan_create(rw->rw_name);
+	if (rw->rw_readwchan == NULL) {
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+	rw->rw_writewchan = wchan_create(rw->rw_name);
+	if (rw->rw_writewchan == NULL) {
+		wchan_destroy(rw->rw_readwchan);
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_init(&rw->rw_lock);
+	rw->rw_readers = 0;
+	rw->rw_writerswaiting = 0;
+	rw->rw_writer = NULL;
+
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_writer == NULL);
+	KASSERT(rw->rw_writerswaiting == 0);
+
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_writewchan);
+	wchan_destroy(rw->rw_readwchan);
+	kfree(rw->rw_name);
+	kfree(rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rw->rw_writer != curthread);
+
+	spinlock_acquire(&rw->rw_lock);
+	while (rw->rw_writer != NULL || rw->rw_writerswaiting > 0) {
+		wchan_lock(rw->rw_readwchan);
+		spinlock_release(&rw->rw_lock);
+		wchan_sleep(rw->rw_readwchan);
+		spinlock_acquire(&rw->rw_lock);
+	}
+	rw->rw_readers++;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rw->rw_writer != curthread);
+
+	spinlock_acquire(&rw->rw_lock);
+	rw->rw_writerswaiting++;
+	while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+		wchan_lock(rw->rw_writewchan);
+		spinlock_release(&rw->rw_lock);
+		wchan_sleep(rw->rw_writewchan);
+		spinlock_acquire(&rw->rw_lock);
+	}
+	rw->rw_writerswaiting--;
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	if (rw->rw_writer == curthread) {
+		rw->rw_writer = NULL;
+	}
+	else {
+		KASSERT(rw->rw_writer == NULL);
+		KASSERT(rw->rw_readers > 0);
+		rw->rw_readers--;
+	}
+
+	/*
+	 * Hand off to the next writer if there is one (once the last
+	 * reader is out); otherwise let in everyone who was waiting to
+	 * read.
+	 */
+	if (rw->rw_writerswaiting > 0) {
+		if (rw->rw_readers == 0) {
+			wchan_wakeone(rw->rw_writewchan);
+		}
+	}
+	else {
+		wchan_wakeall(rw->rw_readwchan);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	return rw->rw_writer == curthread;
+}
@@ -50,13 +50,18 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <slab.h>
 
 #include "opt-synchprobs.h"
+#include "opt-A3.h"
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/* Hardclocks a thread may run at priority PRIO before it is demoted. */
+#define SCHED_QUANTUM(prio) (1U << (prio))
+
 /* Wait channel. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
@@ -72,6 +77,16 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+static struct thread *thread_steal(void);
+static int thread_fork_affinity(const char *name, struct proc *proc,
+				void (*entrypoint)(void *, unsigned long),
+				void *data1, unsigned long data2,
+				uint32_t affinity);
+
+/* Thread structures. */
+static struct kmem_cache thread_cache =
+	KMEM_CACHE_INITIALIZER("thread", sizeof(struct thread), NULL);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -123,14 +138,14 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(&thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kmem_cache_free(&thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -143,9 +158,18 @@ thread_create(const char *name)
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
+	thread->t_prio = 0;
+	thread->t_quantum = 0;
+	thread->t_affinity = CPUMASK_ALL;
+	thread->t_uticks = 0;
+	thread->t_kticks = 0;
+	thread->t_nvcsw = 0;
+	thread->t_nivcsw = 0;
 
 	/* Interrupt state fields */
+	thread->t_usersp = 0;
 	thread->t_in_interrupt = false;
+	thread->t_intr_user = false;
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
@@ -168,6 +192,7 @@ cpu_create(unsigned hardware_number)
 	struct cpu *c;
 	int result;
 	char namebuf[16];
+	unsigned i;
 
 	c = kmalloc(sizeof(*c));
 	if (c == NULL) {
@@ -180,9 +205,16 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_steals = 0;
+	c->c_stealmisses = 0;
+	c->c_handoff = NULL;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<SCHED_NPRIO; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_runcount = 0;
+	c->c_migrations = 0;
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
@@ -194,6 +226,15 @@ cpu_create(unsigned hardware_number)
 		panic("cpu_create: array_add: %s\n", strerror(result));
 	}
 
+	kmag_init(&c->c_kmag, c->c_number);
+
+#if OPT_A3
+	pcache_init(&c->c_pcache, c->c_number);
+	c->c_tlb_asgen = 0;
+	c->c_tlb_next = 0;
+	c->c_tlb_used = 0;
+#endif
+
 	snprintf(namebuf, sizeof(namebuf), "<boot #%d>", c->c_number);
 	c->c_curthread = thread_create(namebuf);
 	if (c->c_curthread == NULL) {
@@ -259,7 +300,7 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(&thread_cache, thread);
 }
 
 /*
@@ -289,6 +330,8 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -303,9 +346,12 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = NULL;
-	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	for (i=0; i<SCHED_NPRIO; i++) {
+		curcpu->c_runqueue[i].tl_count = 0;
+		curcpu->c_runqueue[i].tl_head.tln_next = NULL;
+		curcpu->c_runqueue[i].tl_tail.tln_prev = NULL;
+	}
+	curcpu->c_runcount = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -426,6 +472,114 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Take the most urgent thread off C's run queues, or return NULL if
+ * there isn't one. C's run queue lock must be held.
+ */
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	if (c->c_runcount == 0) {
+		return NULL;
+	}
+	for (i=0; i<SCHED_NPRIO; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_runcount--;
+			return t;
+		}
+	}
+	panic("runqueue_remhead: c_runcount is wrong\n");
+	return NULL;
+}
+
+/*
+ * Take the least urgent thread that may run on cpu TO off C's run
+ * queues, or return NULL if there isn't one. This is what gets
+ * migrated: it would wait longest where it is. C's run queue lock
+ * must be held.
+ */
+static
+struct thread *
+runqueue_remtail(struct cpu *c, struct cpu *to)
+{
+	struct thread *t;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (i=SCHED_NPRIO; i-- > 0; ) {
+		if (threadlist_isempty(&c->c_runqueue[i])) {
+			continue;
+		}
+		THREADLIST_FORALL_REV(t, c->c_runqueue[i]) {
+			if (!CPUMASK_HAS(t->t_affinity, to->c_number)) {
+				continue;
+			}
+			/*
+			 * Ordinarily, curthread will not appear on
+			 * the run queue. However, it can under the
+			 * following circumstances:
+			 *   - it went to sleep;
+			 *   - the processor became idle, so it
+			 *     remained curthread;
+			 *   - it was reawakened, so it was put on the
+			 *     run queue;
+			 *   - and the processor hasn't fully unidled
+			 *     yet, so all these things are still true.
+			 *
+			 * Migrating it would mean running it on TO
+			 * while its stack is still in use on C.
+			 * Leave it be.
+			 */
+			if (t == c->c_curthread) {
+				continue;
+			}
+			threadlist_remove(&c->c_runqueue[i], t);
+			c->c_runcount--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Choose a cpu for a thread that may only run on the cpus in MASK:
+ * an idle one if there is one, otherwise the one with the fewest
+ * runnable threads. Nothing is locked, so the answer may already be
+ * slightly stale; that's fine, it only needs to be a reasonable one.
+ */
+static
+struct cpu *
+thread_pickcpu(uint32_t mask)
+{
+	struct cpu *c, *best;
+	unsigned i, numcpus;
+
+	best = NULL;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (!CPUMASK_HAS(mask, c->c_number)) {
+			continue;
+		}
+		if (c->c_isidle) {
+			return c;
+		}
+		if (best == NULL || c->c_runcount < best->c_runcount) {
+			best = c;
+		}
+	}
+	KASSERT(best != NULL);
+	return best;
+}
+
 /*
  * Make a thread runnable.
  *
@@ -447,10 +601,29 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 	else {
 		spinlock_acquire(&targetcpu->c_runqueue_lock);
+
+		/*
+		 * If the thread may no longer run on its cpu, move it,
+		 * unless that cpu is still running on its stack (see
+		 * runqueue_remtail); then it'll have to wait until it
+		 * next yields. (When we do have the lock, the caller
+		 * has already put it where it belongs.)
+		 */
+		if (!CPUMASK_HAS(target->t_affinity, targetcpu->c_number) &&
+		    targetcpu->c_curthread != target) {
+			spinlock_release(&targetcpu->c_runqueue_lock);
+			targetcpu = thread_pickcpu(target->t_affinity);
+			target->t_cpu = targetcpu;
+			spinlock_acquire(&targetcpu->c_runqueue_lock);
+			targetcpu->c_migrations++;
+		}
 	}
 
+	KASSERT(target->t_prio < SCHED_NPRIO);
+
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	threadlist_addtail(&targetcpu->c_runqueue[target->t_prio], target);
+	targetcpu->c_runcount++;
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -464,6 +637,24 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 }
 
+/*
+ * Send on the thread the last thread_switch on this cpu switched away
+ * from because it may no longer run here. Called right after each
+ * switch, once we're off that thread's stack, with interrupts off.
+ */
+static
+void
+thread_handoff(void)
+{
+	struct thread *t;
+
+	t = curcpu->c_handoff;
+	if (t != NULL) {
+		curcpu->c_handoff = NULL;
+		thread_make_runnable(t, false);
+	}
+}
+
 /*
  * Create a new thread based on an existing one.
  *
@@ -479,6 +670,22 @@ thread_fork(const char *name,
 	    struct proc *proc,
 	    void (*entrypoint)(void *data1, unsigned long data2),
 	    void *data1, unsigned long data2)
+{
+	return thread_fork_affinity(name, proc, entrypoint, data1, data2,
+				    curthread->t_affinity);
+}
+
+/*
+ * thread_fork, but the new thread may only run on the cpus in AFFINITY
+ * rather than the caller's.
+ */
+static
+int
+thread_fork_affinity(const char *name,
+		     struct proc *proc,
+		     void (*entrypoint)(void *data1, unsigned long data2),
+		     void *data1, unsigned long data2,
+		     uint32_t affinity)
 {
 	struct thread *newthread;
 	int result;
@@ -506,6 +713,7 @@ thread_fork(const char *name,
 
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_affinity = affinity;
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -574,7 +782,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && curcpu->c_runcount == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -585,9 +793,29 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	    case S_RUN:
 		panic("Illegal S_RUN in thread_switch\n");
 	    case S_READY:
+		if (cur->t_in_interrupt) {
+			cur->t_nivcsw++;
+		}
+		else {
+			cur->t_nvcsw++;
+		}
+		if (!CPUMASK_HAS(cur->t_affinity, curcpu->c_number)) {
+			/*
+			 * It may not run here any more. It can't go on
+			 * another cpu's run queue while we're still on
+			 * its stack, so leave it to be sent on by the
+			 * thread we switch to (see thread_handoff).
+			 * There is one: the run queue isn't empty.
+			 */
+			KASSERT(curcpu->c_runcount > 0);
+			KASSERT(curcpu->c_handoff == NULL);
+			curcpu->c_handoff = cur;
+			break;
+		}
 		thread_make_runnable(cur, true /*have lock*/);
 		break;
 	    case S_SLEEP:
+		cur->t_nvcsw++;
 		cur->t_wchan_name = wc->wc_name;
 		/*
 		 * Add the thread to the list in the wait channel, and
@@ -613,10 +841,12 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	cur->t_state = newstate;
 
 	/*
-	 * Get the next thread. While there isn't one, call md_idle().
-	 * curcpu->c_isidle must be true when md_idle is
-	 * called. Unlock the runqueue while idling too, to make sure
-	 * things can be added to it.
+	 * Get the next thread. While there isn't one, try to steal
+	 * one from another cpu, and failing that call cpu_idle().
+	 * curcpu->c_isidle must be true when cpu_idle is
+	 * called. Unlock the runqueue while stealing and idling too,
+	 * to make sure things can be added to it (and so we never
+	 * hold two run queue locks at once).
 	 *
 	 * Note that we don't need to unlock the runqueue atomically
 	 * with idling; becoming unidle requires receiving an
@@ -632,12 +862,27 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu->c_self);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			next = thread_steal();
+			if (next == NULL) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
+		if (next != NULL && next != cur &&
+		    !CPUMASK_HAS(next->t_affinity, curcpu->c_number)) {
+			/*
+			 * Its affinity changed while it waited. It isn't
+			 * on anyone's stack, so it can go straight to a
+			 * cpu it may use.
+			 */
+			spinlock_release(&curcpu->c_runqueue_lock);
+			thread_make_runnable(next, false);
+			spinlock_acquire(&curcpu->c_runqueue_lock);
+			next = NULL;
+		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
 
@@ -708,6 +953,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Unlock the run queue. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
+	/* Send on the previous thread if it must move. */
+	thread_handoff();
+
 	/* Activate our address space in the MMU. */
 	as_activate();
 
@@ -741,6 +989,9 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	/* Release the runqueue lock acquired in thread_switch. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
+	/* Send on the previous thread if it must move. */
+	thread_handoff();
+
 	/* Activate our address space in the MMU. */
 	as_activate();
 
@@ -822,139 +1073,323 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multilevel feedback queue. Each CPU has SCHED_NPRIO run
+ * queues, and thread_switch always takes the first thread from the
+ * most urgent one that isn't empty. New threads start at priority 0.
+ *
+ *    - A thread that runs for its whole quantum (SCHED_QUANTUM
+ *      hardclocks, longer at each lower priority) is moved down one
+ *      priority by thread_tick.
+ *
+ *    - A thread woken up from wchan_sleep is moved up one priority.
+ *
+ * So threads that mostly wait, like the menu or a shell reading the
+ * console, stay near the top and get the cpu as soon as they want
+ * it; threads that only compute sink to the bottom, where they run
+ * round-robin in long slices.
+ *
+ * This is called periodically from hardclock(). So that a steady
+ * stream of more urgent threads can't starve the bottom queues
+ * forever, it lifts everything on the current CPU, running or not,
+ * back to priority 0.
  */
 
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct thread *t;
+	unsigned i;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=1; i<SCHED_NPRIO; i++) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueue[i])) != NULL) {
+			t->t_prio = 0;
+			t->t_quantum = 0;
+			threadlist_addtail(&curcpu->c_runqueue[0], t);
+		}
+	}
+	if (!curcpu->c_isidle) {
+		curthread->t_prio = 0;
+		curthread->t_quantum = 0;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+}
+
+/*
+ * Charge a hardclock to the current thread. Once it has used up its
+ * quantum it drops a priority and yields; otherwise it keeps the cpu
+ * unless something more urgent has become runnable.
+ */
+void
+thread_tick(void)
+{
+	struct thread *cur;
+	bool preempt;
+	unsigned i;
+
+	cur = curthread;
+	preempt = false;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	if (curcpu->c_isidle) {
+		/* Interrupted the idle loop; there's nobody to charge. */
+		spinlock_release(&curcpu->c_runqueue_lock);
+		return;
+	}
+	if (cur->t_intr_user) {
+		cur->t_uticks++;
+	}
+	else {
+		cur->t_kticks++;
+	}
+	if (!CPUMASK_HAS(cur->t_affinity, curcpu->c_number)) {
+		/*
+		 * Its affinity changed; move it if we can. That takes
+		 * another thread here to switch to (see thread_switch),
+		 * so without one don't bother yielding; it'll go when
+		 * one turns up or it next sleeps.
+		 */
+		preempt = curcpu->c_runcount > 0;
+	}
+	else if (++cur->t_quantum >= SCHED_QUANTUM(cur->t_prio)) {
+		if (cur->t_prio < SCHED_NPRIO - 1) {
+			cur->t_prio++;
+		}
+		cur->t_quantum = 0;
+		preempt = true;
+	}
+	else {
+		for (i=0; i<cur->t_prio; i++) {
+			if (!threadlist_isempty(&curcpu->c_runqueue[i])) {
+				preempt = true;
+				break;
+			}
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (preempt) {
+		thread_yield();
+	}
 }
 
 /*
  * Thread migration.
  *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
+ * Load is balanced by work stealing: a CPU that has run out of
+ * threads, instead of going straight to sleep in cpu_idle, takes one
+ * from the tail of the busiest run queue it can find. Busy CPUs don't
+ * take part at all, and no CPU ever looks at the others' run queues
+ * except when it is idle anyway.
  *
  * Migrating threads isn't free because of cache affinity; a thread's
  * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
+ * which is fairly slow. But a CPU sitting idle while runnable
+ * threads wait elsewhere is worse, and System/161 does not (yet)
+ * model such cache effects anyway. Taking from the tail means taking
+ * the least urgent thread, which would have waited longest where it
+ * was.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * Called from thread_switch without any run queue lock held and with
+ * interrupts off. Returns the stolen thread, already assigned to the
+ * current CPU, or NULL if there was nothing worth taking.
  */
-void
-thread_consider_migration(void)
+static
+struct thread *
+thread_steal(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
+	struct cpu *c, *victim;
 	struct thread *t;
+	unsigned i, numcpus, most;
 
-	my_count = total_count = 0;
+	/*
+	 * Pick the victim without locking anything. The counts may
+	 * be stale by the time we get there; that just means we steal
+	 * from a slightly wrong place, or find nothing and try again
+	 * on the next hardclock.
+	 */
+	victim = NULL;
+	most = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+		if (c != curcpu->c_self && c->c_runcount > most) {
+			victim = c;
+			most = c->c_runcount;
 		}
-		spinlock_release(&c->c_runqueue_lock);
+	}
+	if (victim == NULL) {
+		return NULL;
 	}
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
+	spinlock_acquire(&victim->c_runqueue_lock);
+	t = runqueue_remtail(victim, curcpu->c_self);
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (t == NULL) {
+		curcpu->c_stealmisses++;
+		return NULL;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	t->t_cpu = curcpu->c_self;
+	curcpu->c_steals++;
+	DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+	      t->t_name, victim->c_number, curcpu->c_number);
+	return t;
+}
+
+/*
+ * What thread_setaffinity and thread_kick fork: it only has to exist,
+ * so that the cpu it's pinned to has something to switch to.
+ */
+static
+void
+thread_affinity_helper(void *data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+}
+
+/*
+ * Check that MASK names at least one cpu that exists.
+ */
+static
+bool
+thread_validaffinity(uint32_t mask)
+{
+	unsigned i, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		if (CPUMASK_HAS(mask, i)) {
+			return true;
+		}
 	}
-	spinlock_release(&curcpu->c_runqueue_lock);
+	return false;
+}
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
+int
+thread_setaffinity(uint32_t mask)
+{
+	struct thread *cur;
+	uint32_t oldmask;
+	int spl, result;
+
+	if (!thread_validaffinity(mask)) {
+		return EINVAL;
+	}
+
+	cur = curthread;
+	oldmask = cur->t_affinity;
+	while (1) {
+		/*
+		 * Pin ourselves to this cpu for the moment, with
+		 * interrupts off so we can't be moved while deciding.
+		 */
+		spl = splhigh();
+		if (CPUMASK_HAS(mask, curcpu->c_number)) {
+			cur->t_affinity = mask;
+			splx(spl);
+			return 0;
 		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
+		cur->t_affinity = (uint32_t)1 << curcpu->c_number;
+		splx(spl);
 
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
+		/*
+		 * We have to get off this cpu. thread_switch can only
+		 * hand us on to another one if there is some other
+		 * thread here to switch to, so make sure there is. The
+		 * helper inherits our mask of the moment, so nobody
+		 * else can steal it. If it gets to run and exit before
+		 * we yield, we're still here; go round again.
+		 */
+		result = thread_fork("affinity", kproc,
+				     thread_affinity_helper, NULL, 0);
+		if (result) {
+			cur->t_affinity = oldmask;
+			return result;
+		}
+		cur->t_affinity = mask;
+		thread_yield();
+	}
+}
+
+int
+thread_setaffinity_other(struct thread *t, uint32_t mask, uint32_t *kick)
+{
+	struct cpu *c;
+
+	KASSERT(t != curthread);
+
+	if (!thread_validaffinity(mask)) {
+		return EINVAL;
+	}
+
+	/*
+	 * Lock the run queue of T's cpu. A thread being stolen gets
+	 * its new t_cpu only after leaving the old queue, so check we
+	 * locked the right one.
+	 */
+	while (1) {
+		c = t->t_cpu;
+		spinlock_acquire(&c->c_runqueue_lock);
+		if (t->t_cpu == c) {
+			break;
 		}
 		spinlock_release(&c->c_runqueue_lock);
 	}
 
+	t->t_affinity = mask;
+
 	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
+	 * If it's sleeping, waking up puts it somewhere it may run. If
+	 * it's waiting to run, thread_switch sends it on when it's
+	 * picked. If it's running, perhaps alone, on a cpu it may no
+	 * longer use, that cpu needs something else to switch to.
 	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+	if (t->t_state == S_RUN && !CPUMASK_HAS(mask, c->c_number)) {
+		*kick |= (uint32_t)1 << c->c_number;
+	}
+
+	spinlock_release(&c->c_runqueue_lock);
+	return 0;
+}
+
+int
+thread_kick(uint32_t cpus)
+{
+	unsigned i, numcpus;
+	int result;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		if (!CPUMASK_HAS(cpus, i)) {
+			continue;
+		}
+		result = thread_fork_affinity("affinity", kproc,
+					      thread_affinity_helper, NULL, 0,
+					      (uint32_t)1 << i);
+		if (result) {
+			return result;
 		}
-		spinlock_release(&curcpu->c_runqueue_lock);
 	}
+	return 0;
+}
+
+void
+thread_printstats(void)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	kprintf("cpu  hardclocks  steals  misses  migrations  runnable\n");
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		kprintf("%3u  %10u  %6u  %6u  %10u  %8u\n", c->c_number,
+			c->c_hardclocks, c->c_steals, c->c_stealmisses,
+			c->c_migrations, c->c_runcount);
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -1028,6 +1463,21 @@ wchan_sleep(struct wchan *wc)
 	thread_switch(S_SLEEP, wc);
 }
 
+/*
+ * Move a thread that is being woken up one priority up (see
+ * schedule()), so that threads that mostly wait get the cpu back
+ * promptly when they want it.
+ */
+static
+void
+thread_boost(struct thread *target)
+{
+	if (target->t_prio > 0) {
+		target->t_prio--;
+	}
+	target->t_quantum = 0;
+}
+
 /*
  * Wake up one thread sleeping on a wait channel.
  */
@@ -1050,6 +1500,7 @@ wchan_wakeone(struct wchan *wc)
 		return;
 	}
 
+	thread_boost(target);
 	thread_make_runnable(target, false);
 }
 
@@ -1084,6 +1535,7 @@ wchan_wakeall(struct wchan *wc)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
+		thread_boost(target);
 		thread_make_runnable(target, false);
 	}
 
@@ -1162,6 +1614,23 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+unsigned
+ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping)
+{
+	unsigned i, n;
+	struct cpu *c;
+
+	n = 0;
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self) {
+			ipi_tlbshootdown(c, mapping);
+			n++;
+		}
+	}
+	return n;
+}
+
 void
 interprocessor_interrupt(void)
 {
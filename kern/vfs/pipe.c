@@ -0,0 +1,527 @@
+/*
+ * Anonymous pipes. See pipe.h.
+ *
+ * Data is copied between the user and a small buffer on the stack
+ * with the pipe unlocked, and only copied between that buffer and
+ * the ring with it locked. The user copy can fault, and paging can
+ * need vfs_biglock, which is held when the last close of an end
+ * comes here; so pp_lock must never be held across a uiomove.
+ *
+ * Wakeups are batched. A writer wakes sleeping readers when the ring
+ * gets half full, when it has to wait for room, and when its write is
+ * done, not for every chunk it copies in. Likewise a reader wakes
+ * sleeping writers when half the ring is free or when its read is
+ * done, and then only if the room they are waiting for is there.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <limits.h>
+#include <stat.h>
+#include <synch.h>
+#include <uio.h>
+#include <vm.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <pipe.h>
+
+#define PIPE_SIZE   PAGE_SIZE	/* bytes the ring holds */
+#define PIPE_CHUNK  PIPE_BUF	/* bytes moved per trip through pp_lock */
+
+struct pipe {
+	struct lock *pp_lock;
+	struct cv *pp_readcv;		/* readers wait for data */
+	struct cv *pp_writecv;		/* writers wait for room */
+	char *pp_buf;			/* the ring, PIPE_SIZE bytes */
+	unsigned pp_head;		/* next byte to read */
+	unsigned pp_count;		/* bytes in the ring */
+	bool pp_readopen;		/* some reader still has it open */
+	bool pp_writeopen;		/* some writer still has it open */
+	unsigned pp_readwaiters;
+	unsigned pp_writewaiters;
+	unsigned pp_wantroom;		/* least room a waiting writer needs */
+	unsigned pp_nvnodes;		/* ends not yet reclaimed */
+	struct vnode pp_readvn;
+	struct vnode pp_writevn;
+};
+
+static const struct vnode_ops pipe_vnode_ops;
+
+static
+void
+pipe_destroy(struct pipe *pp)
+{
+	cv_destroy(pp->pp_writecv);
+	cv_destroy(pp->pp_readcv);
+	lock_destroy(pp->pp_lock);
+	kfree(pp->pp_buf);
+	kfree(pp);
+}
+
+int
+pipe_create(struct vnode **readvn, struct vnode **writevn)
+{
+	struct pipe *pp;
+
+	pp = kmalloc(sizeof(struct pipe));
+	if (pp == NULL) {
+		return ENOMEM;
+	}
+	pp->pp_buf = kmalloc(PIPE_SIZE);
+	pp->pp_lock = lock_create("pipe");
+	pp->pp_readcv = cv_create("pipe read");
+	pp->pp_writecv = cv_create("pipe write");
+	if (pp->pp_buf == NULL || pp->pp_lock == NULL ||
+	    pp->pp_readcv == NULL || pp->pp_writecv == NULL) {
+		if (pp->pp_writecv != NULL) {
+			cv_destroy(pp->pp_writecv);
+		}
+		if (pp->pp_readcv != NULL) {
+			cv_destroy(pp->pp_readcv);
+		}
+		if (pp->pp_lock != NULL) {
+			lock_destroy(pp->pp_lock);
+		}
+		if (pp->pp_buf != NULL) {
+			kfree(pp->pp_buf);
+		}
+		kfree(pp);
+		return ENOMEM;
+	}
+	pp->pp_head = 0;
+	pp->pp_count = 0;
+	pp->pp_readopen = true;
+	pp->pp_writeopen = true;
+	pp->pp_readwaiters = 0;
+	pp->pp_writewaiters = 0;
+	pp->pp_wantroom = PIPE_SIZE;
+	pp->pp_nvnodes = 2;
+
+	VOP_INIT(&pp->pp_readvn, &pipe_vnode_ops, NULL, pp);
+	VOP_INIT(&pp->pp_writevn, &pipe_vnode_ops, NULL, pp);
+	VOP_INCOPEN(&pp->pp_readvn);
+	VOP_INCOPEN(&pp->pp_writevn);
+
+	*readvn = &pp->pp_readvn;
+	*writevn = &pp->pp_writevn;
+	return 0;
+}
+
+/*
+ * Wake waiting writers if there's room for them. If BATCH, only do it
+ * once half the ring is free, since the caller will be back.
+ */
+static
+void
+pipe_wakewriters(struct pipe *pp, bool batch)
+{
+	unsigned room;
+
+	KASSERT(lock_do_i_hold(pp->pp_lock));
+
+	room = PIPE_SIZE - pp->pp_count;
+	if (pp->pp_writewaiters == 0 || room < pp->pp_wantroom ||
+	    (batch && room < PIPE_SIZE / 2)) {
+		return;
+	}
+	/* They set it again if they have to go back to sleep. */
+	pp->pp_wantroom = PIPE_SIZE;
+	cv_broadcast(pp->pp_writecv, pp->pp_lock);
+}
+
+/*
+ * Wake waiting readers if there's data. If BATCH, only do it once the
+ * ring is half full.
+ */
+static
+void
+pipe_wakereaders(struct pipe *pp, bool batch)
+{
+	KASSERT(lock_do_i_hold(pp->pp_lock));
+
+	if (pp->pp_readwaiters == 0 || pp->pp_count == 0 ||
+	    (batch && pp->pp_count < PIPE_SIZE / 2)) {
+		return;
+	}
+	cv_broadcast(pp->pp_readcv, pp->pp_lock);
+}
+
+/*
+ * Read. Wait for the first byte, then take whatever there is, up to
+ * what was asked for, without waiting again.
+ */
+static
+int
+pipe_read(struct vnode *v, struct uio *uio)
+{
+	struct pipe *pp = v->vn_data;
+	char buf[PIPE_CHUNK];
+	unsigned n, first;
+	int result;
+
+	KASSERT(uio->uio_rw == UIO_READ);
+	KASSERT(v == &pp->pp_readvn);
+
+	result = 0;
+	lock_acquire(pp->pp_lock);
+	while (pp->pp_count == 0 && pp->pp_writeopen) {
+		pp->pp_readwaiters++;
+		cv_wait(pp->pp_readcv, pp->pp_lock);
+		pp->pp_readwaiters--;
+	}
+	while (uio->uio_resid > 0 && pp->pp_count > 0) {
+		n = pp->pp_count;
+		if (n > uio->uio_resid) {
+			n = uio->uio_resid;
+		}
+		if (n > PIPE_CHUNK) {
+			n = PIPE_CHUNK;
+		}
+		first = PIPE_SIZE - pp->pp_head;
+		if (first > n) {
+			first = n;
+		}
+		memcpy(buf, pp->pp_buf + pp->pp_head, first);
+		memcpy(buf + first, pp->pp_buf, n - first);
+		pp->pp_head = (pp->pp_head + n) % PIPE_SIZE;
+		pp->pp_count -= n;
+		pipe_wakewriters(pp, true);
+		lock_release(pp->pp_lock);
+
+		result = uiomove(buf, n, uio);
+
+		lock_acquire(pp->pp_lock);
+		if (result) {
+			break;
+		}
+	}
+	pipe_wakewriters(pp, false);
+	lock_release(pp->pp_lock);
+	return result;
+}
+
+/*
+ * Write. A write of PIPE_BUF bytes or less waits until it fits and
+ * goes in as one chunk. A longer one goes in a chunk at a time as
+ * room appears, and may be interleaved with other writers.
+ */
+static
+int
+pipe_write(struct vnode *v, struct uio *uio)
+{
+	struct pipe *pp = v->vn_data;
+	char buf[PIPE_CHUNK];
+	unsigned n, tail, first;
+	size_t before;
+	int result;
+
+	KASSERT(uio->uio_rw == UIO_WRITE);
+	KASSERT(v == &pp->pp_writevn);
+
+	before = uio->uio_resid;
+	result = 0;
+	while (uio->uio_resid > 0) {
+		n = uio->uio_resid;
+		if (n > PIPE_CHUNK) {
+			n = PIPE_CHUNK;
+		}
+		result = uiomove(buf, n, uio);
+		if (result) {
+			break;
+		}
+
+		lock_acquire(pp->pp_lock);
+		while (pp->pp_readopen && PIPE_SIZE - pp->pp_count < n) {
+			/* Let the readers make room. */
+			pipe_wakereaders(pp, false);
+			if (pp->pp_writewaiters == 0 || n < pp->pp_wantroom) {
+				pp->pp_wantroom = n;
+			}
+			pp->pp_writewaiters++;
+			cv_wait(pp->pp_writecv, pp->pp_lock);
+			pp->pp_writewaiters--;
+		}
+		if (!pp->pp_readopen) {
+			lock_release(pp->pp_lock);
+			/* This chunk didn't go anywhere. */
+			uio->uio_resid += n;
+			result = EPIPE;
+			break;
+		}
+		tail = (pp->pp_head + pp->pp_count) % PIPE_SIZE;
+		first = PIPE_SIZE - tail;
+		if (first > n) {
+			first = n;
+		}
+		memcpy(pp->pp_buf + tail, buf, first);
+		memcpy(pp->pp_buf, buf + first, n - first);
+		pp->pp_count += n;
+		pipe_wakereaders(pp, uio->uio_resid > 0);
+		lock_release(pp->pp_lock);
+	}
+
+	/* A write that got some of the way reports that, not the error. */
+	if (result == EPIPE && uio->uio_resid < before) {
+		result = 0;
+	}
+	return result;
+}
+
+/*
+ * Last close of one end. Closing the write end gives readers EOF once
+ * the ring is empty; closing the read end makes writers fail.
+ */
+static
+int
+pipe_close(struct vnode *v)
+{
+	struct pipe *pp = v->vn_data;
+
+	lock_acquire(pp->pp_lock);
+	if (v == &pp->pp_readvn) {
+		pp->pp_readopen = false;
+		cv_broadcast(pp->pp_writecv, pp->pp_lock);
+	}
+	else {
+		pp->pp_writeopen = false;
+		cv_broadcast(pp->pp_readcv, pp->pp_lock);
+	}
+	lock_release(pp->pp_lock);
+	return 0;
+}
+
+/*
+ * Last reference to one end. The pipe goes when both ends have.
+ * Called with vfs_biglock held, which is what protects pp_nvnodes.
+ */
+static
+int
+pipe_reclaim(struct vnode *v)
+{
+	struct pipe *pp = v->vn_data;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	VOP_CLEANUP(v);
+	KASSERT(pp->pp_nvnodes > 0);
+	pp->pp_nvnodes--;
+	if (pp->pp_nvnodes == 0) {
+		pipe_destroy(pp);
+	}
+	return 0;
+}
+
+static
+int
+pipe_open(struct vnode *v, int flags)
+{
+	(void)v;
+	(void)flags;
+	/* Pipes can't be opened by name. */
+	return EINVAL;
+}
+
+static
+int
+pipe_gettype(struct vnode *v, mode_t *ret)
+{
+	(void)v;
+	*ret = S_IFIFO;
+	return 0;
+}
+
+/*
+ * stat() reports the bytes waiting to be read as the size.
+ */
+static
+int
+pipe_stat(struct vnode *v, struct stat *statbuf)
+{
+	struct pipe *pp = v->vn_data;
+
+	bzero(statbuf, sizeof(struct stat));
+	statbuf->st_mode = S_IFIFO | 0600;
+	statbuf->st_nlink = 1;
+	statbuf->st_size = pp->pp_count;
+	statbuf->st_blksize = PIPE_BUF;
+	return 0;
+}
+
+static
+int
+pipe_tryseek(struct vnode *v, off_t pos)
+{
+	(void)v;
+	(void)pos;
+	return ESPIPE;
+}
+
+/*
+ * Operations that don't mean anything on a pipe.
+ */
+
+static
+int
+pipe_badio(struct vnode *v, struct uio *uio)
+{
+	(void)v;
+	(void)uio;
+	return EINVAL;
+}
+
+static
+int
+pipe_ioctl(struct vnode *v, int op, userptr_t data)
+{
+	(void)v;
+	(void)op;
+	(void)data;
+	return EINVAL;
+}
+
+static
+int
+pipe_fsync(struct vnode *v)
+{
+	(void)v;
+	return 0;
+}
+
+static
+int
+pipe_mmap(struct vnode *v)
+{
+	(void)v;
+	return EUNIMP;
+}
+
+static
+int
+pipe_truncate(struct vnode *v, off_t len)
+{
+	(void)v;
+	(void)len;
+	return EINVAL;
+}
+
+static
+int
+pipe_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
+	   struct vnode **result)
+{
+	(void)v;
+	(void)name;
+	(void)excl;
+	(void)mode;
+	(void)result;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_symlink(struct vnode *v, const char *contents, const char *name)
+{
+	(void)v;
+	(void)contents;
+	(void)name;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_mkdir(struct vnode *v, const char *name, mode_t mode)
+{
+	(void)v;
+	(void)name;
+	(void)mode;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_link(struct vnode *v, const char *name, struct vnode *file)
+{
+	(void)v;
+	(void)name;
+	(void)file;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_nameop(struct vnode *v, const char *name)
+{
+	(void)v;
+	(void)name;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_rename(struct vnode *v, const char *n1, struct vnode *v2, const char *n2)
+{
+	(void)v;
+	(void)n1;
+	(void)v2;
+	(void)n2;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_lookup(struct vnode *v, char *pathname, struct vnode **result)
+{
+	(void)v;
+	(void)pathname;
+	(void)result;
+	return ENOTDIR;
+}
+
+static
+int
+pipe_lookparent(struct vnode *v, char *pathname, struct vnode **result,
+		char *namebuf, size_t buflen)
+{
+	(void)v;
+	(void)pathname;
+	(void)result;
+	(void)namebuf;
+	(void)buflen;
+	return ENOTDIR;
+}
+
+/*
+ * Function table for pipe vnodes. Both ends share it; read and write
+ * check which end they were called on.
+ */
+static const struct vnode_ops pipe_vnode_ops = {
+	VOP_MAGIC,
+
+	pipe_open,
+	pipe_close,
+	pipe_reclaim,
+	pipe_read,
+	pipe_badio,   /* readlink */
+	pipe_badio,   /* getdirentry */
+	pipe_write,
+	pipe_ioctl,
+	pipe_stat,
+	pipe_gettype,
+	pipe_tryseek,
+	pipe_fsync,
+	pipe_mmap,
+	pipe_truncate,
+	pipe_badio,   /* namefile */
+	pipe_creat,
+	pipe_symlink,
+	pipe_mkdir,
+	pipe_link,
+	pipe_nameop,  /* remove */
+	pipe_nameop,  /* rmdir */
+	pipe_rename,
+	pipe_lookup,
+	pipe_lookparent,
+};
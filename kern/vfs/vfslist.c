@@ -87,6 +87,18 @@ DEFARRAY(knowndev, /*no inline*/);
 
 static struct knowndevarray *knowndevs;
 
+/*
+ * The knowndevs table, and the kd_fs of its entries, are changed only
+ * with both vfs_biglock and a write lock on knowndevs_lock held, and
+ * may be read with either one. Take vfs_biglock first.
+ *
+ * vfs_getdevname only reads the table, so it uses the read lock.
+ * vfs_getroot still needs vfs_biglock: it calls into the file system,
+ * which takes vfs_biglock itself and so can't be called with only
+ * knowndevs_lock held.
+ */
+static struct rwlock *knowndevs_lock;
+
 /* The big lock for all FS ops. Remove for filesystem assignment. */
 static struct lock *vfs_biglock;
 static unsigned vfs_biglock_depth;
@@ -109,6 +121,11 @@ vfs_bootstrap(void)
 	}
 	vfs_biglock_depth = 0;
 
+	knowndevs_lock = rwlock_create("knowndevs");
+	if (knowndevs_lock==NULL) {
+		panic("vfs: Could not create knowndevs lock\n");
+	}
+
 	devnull_create();
 }
 
@@ -261,7 +278,7 @@ vfs_getdevname(struct fs *fs)
 
 	KASSERT(fs != NULL);
 
-	KASSERT(vfs_biglock_do_i_hold());
+	rwlock_acquire_read(knowndevs_lock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -274,10 +291,12 @@ vfs_getdevname(struct fs *fs)
 			 * the fs cannot go away, and the device can't
 			 * go away until the fs goes away.
 			 */
+			rwlock_release(knowndevs_lock);
 			return kd->kd_name;
 		}
 	}
 
+	rwlock_release(knowndevs_lock);
 	return NULL;
 }
 
@@ -416,7 +435,9 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		return EEXIST;
 	}
 
+	rwlock_acquire_write(knowndevs_lock);
 	result = knowndevarray_add(knowndevs, kd, &index);
+	rwlock_release(knowndevs_lock);
 
 	if (result == 0 && dev != NULL) {
 		/* use index+1 as the device number, so 0 is reserved */
@@ -470,7 +491,7 @@ vfs_addfs(const char *devname, struct fs *fs)
 
 /*
  * Look for a mountable device named DEVNAME.
- * Should already hold knowndevs_lock.
+ * Should already hold vfs_biglock.
  */
 static
 int
@@ -537,7 +558,9 @@ vfs_mount(const char *devname, void *data,
 
 	KASSERT(fs != NULL);
 
+	rwlock_acquire_write(knowndevs_lock);
 	kd->kd_fs = fs;
+	rwlock_release(knowndevs_lock);
 
 	volname = FSOP_GETVOLNAME(fs);
 	kprintf("vfs: Mounted %s: on %s\n",
@@ -581,10 +604,12 @@ vfs_unmount(const char *devname)
 		goto fail;
 	}
 
-	kprintf("vfs: Unmounted %s:\n", kd->kd_name);
-
 	/* now drop the filesystem */
+	rwlock_acquire_write(knowndevs_lock);
 	kd->kd_fs = NULL;
+	rwlock_release(knowndevs_lock);
+
+	kprintf("vfs: Unmounted %s:\n", kd->kd_name);
 
 	KASSERT(result==0);
 
@@ -634,6 +659,13 @@ vfs_unmountall(void)
 		}
 
 		result = FSOP_UNMOUNT(dev->kd_fs);
+		if (result == 0) {
+			/* now drop the filesystem */
+			rwlock_acquire_write(knowndevs_lock);
+			dev->kd_fs = NULL;
+			rwlock_release(knowndevs_lock);
+		}
+
 		if (result == EBUSY) {
 			kprintf("vfs: Cannot unmount %s: (busy)\n", 
 				dev->kd_name);
@@ -645,9 +677,6 @@ vfs_unmountall(void)
 				dev->kd_name, strerror(result));
 			continue;
 		}
-
-		/* now drop the filesystem */
-		dev->kd_fs = NULL;
 	}
 
 	vfs_biglock_release();
@@ -0,0 +1,630 @@
+/*
+ * Buddy allocator for physical page frames.
+ *
+ * The coremap itself lives in the first few frames of free RAM, one
+ * entry per managed frame. Free blocks are kept on doubly linked
+ * lists (threaded through the coremap entries by frame index) so a
+ * buddy can be pulled off its list in constant time when merging.
+ *
+ * Entries for user pages also carry a reverse mapping (address space
+ * and virtual address) and a software reference bit, which the clock
+ * in coremap_clock uses to choose pages to swap out.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <cpu.h>
+#include <current.h>
+#include <vm.h>
+#include <coremap.h>
+#include <platform/maxcpus.h>
+
+#define CM_NONE (-1)
+
+/* cme_flags */
+#define CME_FREE   0x01		/* frame heads a block on a free list */
+#define CME_HEAD   0x02		/* frame heads an allocated block */
+#define CME_REF    0x04		/* user page used since the clock last passed */
+
+struct coremap_entry {
+	int cme_next;		/* free list links (frame indices) */
+	int cme_prev;
+	uint8_t cme_order;	/* order of the block this frame heads */
+	uint8_t cme_flags;
+	uint16_t cme_refcount;	/* page tables mapping this frame */
+	struct addrspace *cme_as;	/* sole owner of a pageable user page */
+	vaddr_t cme_vaddr;	/* where cme_as maps it */
+};
+
+static struct coremap_entry *coremap;
+static int cm_nframes;			/* number of managed frames */
+static paddr_t cm_base;			/* paddr of frame 0 */
+static int cm_freelist[CM_MAXORDER + 1];
+static unsigned cm_nfree;		/* free frames, for stats */
+static struct lock *coremap_lock;
+static volatile bool coremap_created = false;
+static int cm_clockhand;		/* next frame coremap_clock looks at */
+
+/* Protects cme_refcount, which fork and exit bump on every user page. */
+static struct spinlock cm_reflock = SPINLOCK_INITIALIZER;
+
+/* Every cpu's magazine, for stats and for draining on memory pressure. */
+static struct pcache *pcaches[MAXCPUS];
+static unsigned npcaches;
+
+#define CM_INDEX(pa)  ((int)(((pa) - cm_base) / PAGE_SIZE))
+#define CM_PADDR(i)   (cm_base + (paddr_t)(i) * PAGE_SIZE)
+
+////////////////////////////////////////
+
+static
+void
+freelist_push(int idx, unsigned order)
+{
+	struct coremap_entry *e = &coremap[idx];
+
+	e->cme_flags = CME_FREE;
+	e->cme_order = order;
+	e->cme_prev = CM_NONE;
+	e->cme_next = cm_freelist[order];
+	if (e->cme_next != CM_NONE) {
+		coremap[e->cme_next].cme_prev = idx;
+	}
+	cm_freelist[order] = idx;
+}
+
+static
+void
+freelist_remove(int idx)
+{
+	struct coremap_entry *e = &coremap[idx];
+
+	KASSERT(e->cme_flags & CME_FREE);
+	if (e->cme_prev != CM_NONE) {
+		coremap[e->cme_prev].cme_next = e->cme_next;
+	}
+	else {
+		cm_freelist[e->cme_order] = e->cme_next;
+	}
+	if (e->cme_next != CM_NONE) {
+		coremap[e->cme_next].cme_prev = e->cme_prev;
+	}
+	e->cme_flags = 0;
+	e->cme_next = e->cme_prev = CM_NONE;
+}
+
+/*
+ * Smallest order whose block holds NPAGES frames.
+ */
+static
+unsigned
+npages_to_order(unsigned long npages)
+{
+	unsigned order = 0;
+
+	while (((unsigned long)1 << order) < npages) {
+		order++;
+	}
+	return order;
+}
+
+////////////////////////////////////////
+
+void
+coremap_bootstrap(void)
+{
+	paddr_t first, last;
+	int total, cm_pages, idx;
+	unsigned order;
+
+	coremap_lock = lock_create("coremap_lock");
+	if (coremap_lock == NULL) {
+		panic("coremap_bootstrap: could not create coremap_lock\n");
+	}
+
+	/* No more ram_stealmem after this. */
+	ram_getsize(&first, &last);
+	KASSERT(first % PAGE_SIZE == 0);
+
+	total = (last - first) / PAGE_SIZE;
+	cm_pages = (total * sizeof(struct coremap_entry) + PAGE_SIZE - 1)
+		/ PAGE_SIZE;
+	KASSERT(cm_pages < total);
+
+	coremap = (struct coremap_entry *)PADDR_TO_KVADDR(first);
+	cm_base = first + cm_pages * PAGE_SIZE;
+	cm_nframes = total - cm_pages;
+
+	for (order = 0; order <= CM_MAXORDER; order++) {
+		cm_freelist[order] = CM_NONE;
+	}
+	for (idx = 0; idx < cm_nframes; idx++) {
+		coremap[idx].cme_next = coremap[idx].cme_prev = CM_NONE;
+		coremap[idx].cme_order = 0;
+		coremap[idx].cme_flags = 0;
+		coremap[idx].cme_refcount = 0;
+		coremap[idx].cme_as = NULL;
+		coremap[idx].cme_vaddr = 0;
+	}
+
+	/*
+	 * Carve the frames into the largest naturally aligned blocks
+	 * that fit. The tail of memory ends up as a handful of
+	 * smaller blocks.
+	 */
+	idx = 0;
+	while (idx < cm_nframes) {
+		order = CM_MAXORDER;
+		while ((idx & ((1 << order) - 1)) != 0 ||
+		       idx + (1 << order) > cm_nframes) {
+			order--;
+		}
+		freelist_push(idx, order);
+		idx += 1 << order;
+	}
+	cm_nfree = cm_nframes;
+
+	coremap_created = true;
+	kprintf("coremap: %d frames managed, %d used by coremap\n",
+		cm_nframes, cm_pages);
+}
+
+bool
+coremap_ready(void)
+{
+	return coremap_created;
+}
+
+/*
+ * Take a block of 2^ORDER frames off the free lists, splitting a
+ * larger one if needed. Returns the frame index or CM_NONE.
+ */
+static
+int
+cm_alloc_locked(unsigned order)
+{
+	unsigned k;
+	int idx;
+
+	KASSERT(lock_do_i_hold(coremap_lock));
+
+	for (k = order; k <= CM_MAXORDER; k++) {
+		if (cm_freelist[k] != CM_NONE) {
+			break;
+		}
+	}
+	if (k > CM_MAXORDER) {
+		return CM_NONE;
+	}
+
+	idx = cm_freelist[k];
+	freelist_remove(idx);
+
+	/* Split, handing the upper halves back to the free lists. */
+	while (k > order) {
+		k--;
+		freelist_push(idx + (1 << k), k);
+	}
+
+	coremap[idx].cme_flags = CME_HEAD;
+	coremap[idx].cme_order = order;
+	cm_nfree -= 1 << order;
+	return idx;
+}
+
+/*
+ * Return the block headed by frame IDX to the free lists, merging it
+ * with its buddy for as long as the buddy is free.
+ */
+static
+void
+cm_free_locked(int idx)
+{
+	int buddy;
+	unsigned order;
+
+	KASSERT(lock_do_i_hold(coremap_lock));
+	KASSERT(idx >= 0 && idx < cm_nframes);
+
+	if ((coremap[idx].cme_flags & CME_HEAD) == 0) {
+		panic("coremap_free: 0x%x is not an allocated block\n",
+		      CM_PADDR(idx));
+	}
+	order = coremap[idx].cme_order;
+	coremap[idx].cme_flags = 0;
+	cm_nfree += 1 << order;
+
+	while (order < CM_MAXORDER) {
+		buddy = idx ^ (1 << order);
+		if (buddy >= cm_nframes ||
+		    (coremap[buddy].cme_flags & CME_FREE) == 0 ||
+		    coremap[buddy].cme_order != order) {
+			break;
+		}
+		freelist_remove(buddy);
+		if (buddy < idx) {
+			idx = buddy;
+		}
+		order++;
+	}
+	freelist_push(idx, order);
+}
+
+static
+void
+cm_free_batch(paddr_t *frames, unsigned n)
+{
+	unsigned i;
+
+	if (n == 0) {
+		return;
+	}
+	lock_acquire(coremap_lock);
+	for (i = 0; i < n; i++) {
+		cm_free_locked(CM_INDEX(frames[i]));
+	}
+	lock_release(coremap_lock);
+}
+
+////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+// A magazine is only ever touched under its own spinlock, which also
+// keeps us from being preempted halfway through. We look it up via
+// curcpu but do not care if we migrate right after: using another
+// cpu's magazine is merely slower, never wrong.
+
+void
+pcache_init(struct pcache *pc, unsigned cpunum)
+{
+	KASSERT(cpunum < MAXCPUS);
+
+	spinlock_init(&pc->pc_lock);
+	pc->pc_count = 0;
+	pc->pc_hits = 0;
+	pc->pc_misses = 0;
+	pc->pc_frees = 0;
+	pc->pc_drains = 0;
+
+	pcaches[cpunum] = pc;
+	if (cpunum >= npcaches) {
+		npcaches = cpunum + 1;
+	}
+}
+
+static
+paddr_t
+pcache_get(void)
+{
+	struct pcache *pc;
+	paddr_t frames[PCACHE_BATCH];
+	paddr_t pa;
+	unsigned i, n;
+	int idx;
+
+	pc = &curcpu->c_pcache;
+
+	spinlock_acquire(&pc->pc_lock);
+	if (pc->pc_count > 0) {
+		pa = pc->pc_frames[--pc->pc_count];
+		pc->pc_hits++;
+		spinlock_release(&pc->pc_lock);
+		return pa;
+	}
+	pc->pc_misses++;
+	spinlock_release(&pc->pc_lock);
+
+	/* Empty; refill a batch with one trip through coremap_lock. */
+	lock_acquire(coremap_lock);
+	for (n = 0; n < PCACHE_BATCH; n++) {
+		idx = cm_alloc_locked(0);
+		if (idx == CM_NONE) {
+			break;
+		}
+		frames[n] = CM_PADDR(idx);
+	}
+	lock_release(coremap_lock);
+
+	if (n == 0) {
+		return 0;
+	}
+
+	/* Keep frames[0] for the caller; stash the rest. */
+	spinlock_acquire(&pc->pc_lock);
+	for (i = 1; i < n && pc->pc_count < PCACHE_SIZE; i++) {
+		pc->pc_frames[pc->pc_count++] = frames[i];
+	}
+	spinlock_release(&pc->pc_lock);
+
+	/* Someone else refilled it while we were away. */
+	cm_free_batch(&frames[i], n - i);
+
+	return frames[0];
+}
+
+static
+void
+pcache_put(paddr_t pa)
+{
+	struct pcache *pc;
+	paddr_t frames[PCACHE_BATCH];
+	unsigned n;
+
+	pc = &curcpu->c_pcache;
+
+	spinlock_acquire(&pc->pc_lock);
+	if (pc->pc_count < PCACHE_SIZE) {
+		pc->pc_frames[pc->pc_count++] = pa;
+		pc->pc_frees++;
+		spinlock_release(&pc->pc_lock);
+		return;
+	}
+
+	/* Full; send this frame and a batch of others back. */
+	frames[0] = pa;
+	for (n = 1; n < PCACHE_BATCH; n++) {
+		frames[n] = pc->pc_frames[--pc->pc_count];
+	}
+	pc->pc_drains++;
+	spinlock_release(&pc->pc_lock);
+
+	cm_free_batch(frames, n);
+}
+
+/*
+ * Push every magazine back to the buddy lists so that cached single
+ * frames can coalesce. Used when a multi-page allocation fails.
+ */
+static
+void
+pcache_drain_all(void)
+{
+	struct pcache *pc;
+	paddr_t frames[PCACHE_SIZE];
+	unsigned i, n;
+
+	for (i = 0; i < npcaches; i++) {
+		pc = pcaches[i];
+		if (pc == NULL) {
+			continue;
+		}
+		spinlock_acquire(&pc->pc_lock);
+		for (n = 0; pc->pc_count > 0; n++) {
+			frames[n] = pc->pc_frames[--pc->pc_count];
+		}
+		if (n > 0) {
+			pc->pc_drains++;
+		}
+		spinlock_release(&pc->pc_lock);
+
+		cm_free_batch(frames, n);
+	}
+}
+
+////////////////////////////////////////
+
+paddr_t
+coremap_alloc(unsigned long npages)
+{
+	unsigned order;
+	paddr_t pa;
+	int idx;
+
+	KASSERT(coremap_created);
+	KASSERT(npages > 0);
+
+	if (npages == 1) {
+		pa = pcache_get();
+		if (pa != 0) {
+			coremap[CM_INDEX(pa)].cme_refcount = 1;
+			coremap[CM_INDEX(pa)].cme_as = NULL;
+			return pa;
+		}
+	}
+
+	order = npages_to_order(npages);
+	if (order > CM_MAXORDER) {
+		return 0;
+	}
+
+	lock_acquire(coremap_lock);
+	idx = cm_alloc_locked(order);
+	lock_release(coremap_lock);
+
+	if (idx == CM_NONE) {
+		/* The magazines may be holding what we need. */
+		pcache_drain_all();
+		lock_acquire(coremap_lock);
+		idx = cm_alloc_locked(order);
+		lock_release(coremap_lock);
+		if (idx == CM_NONE) {
+			return 0;
+		}
+	}
+
+	coremap[idx].cme_refcount = 1;
+	coremap[idx].cme_as = NULL;
+	return CM_PADDR(idx);
+}
+
+void
+coremap_free(paddr_t pa)
+{
+	int idx;
+
+	KASSERT(pa % PAGE_SIZE == 0);
+
+	if (!coremap_created || pa < cm_base) {
+		/* Stolen before the coremap existed; leak it. */
+		return;
+	}
+
+	idx = CM_INDEX(pa);
+	KASSERT(idx < cm_nframes);
+	coremap[idx].cme_as = NULL;
+
+	/*
+	 * We own the block, so its order can't change under us and
+	 * it is safe to peek at without the lock.
+	 */
+	if (coremap[idx].cme_order == 0) {
+		KASSERT(coremap[idx].cme_flags & CME_HEAD);
+		pcache_put(pa);
+		return;
+	}
+
+	lock_acquire(coremap_lock);
+	cm_free_locked(idx);
+	lock_release(coremap_lock);
+}
+
+void
+coremap_incref(paddr_t pa)
+{
+	int idx = CM_INDEX(pa);
+
+	KASSERT(pa >= cm_base && idx < cm_nframes);
+
+	spinlock_acquire(&cm_reflock);
+	KASSERT(coremap[idx].cme_refcount > 0);
+	coremap[idx].cme_refcount++;
+	/* Shared now; no single page table to evict it from. */
+	coremap[idx].cme_as = NULL;
+	spinlock_release(&cm_reflock);
+}
+
+void
+coremap_decref(paddr_t pa)
+{
+	int idx = CM_INDEX(pa);
+	unsigned ref;
+
+	KASSERT(pa >= cm_base && idx < cm_nframes);
+
+	spinlock_acquire(&cm_reflock);
+	KASSERT(coremap[idx].cme_refcount > 0);
+	ref = --coremap[idx].cme_refcount;
+	spinlock_release(&cm_reflock);
+
+	if (ref == 0) {
+		coremap_free(pa);
+	}
+}
+
+unsigned
+coremap_refcount(paddr_t pa)
+{
+	int idx = CM_INDEX(pa);
+	unsigned ref;
+
+	KASSERT(pa >= cm_base && idx < cm_nframes);
+
+	spinlock_acquire(&cm_reflock);
+	ref = coremap[idx].cme_refcount;
+	spinlock_release(&cm_reflock);
+	return ref;
+}
+
+void
+coremap_set_owner(paddr_t pa, struct addrspace *as, vaddr_t va)
+{
+	int idx = CM_INDEX(pa);
+
+	KASSERT(pa >= cm_base && idx < cm_nframes);
+	KASSERT(coremap[idx].cme_refcount == 1);
+	KASSERT((va & ~(vaddr_t)PAGE_FRAME) == 0);
+
+	coremap[idx].cme_as = as;
+	coremap[idx].cme_vaddr = va;
+	coremap[idx].cme_flags |= CME_REF;
+}
+
+void
+coremap_touch(paddr_t pa)
+{
+	int idx = CM_INDEX(pa);
+
+	KASSERT(pa >= cm_base && idx < cm_nframes);
+
+	if (coremap[idx].cme_as != NULL) {
+		coremap[idx].cme_flags |= CME_REF;
+	}
+}
+
+/*
+ * Second-chance clock: sweep the hand over the frames, clearing the
+ * reference bit of each owned user page it passes, and stop at the
+ * first one whose bit was already clear. Two full turns are enough
+ * to find a victim if there is any.
+ */
+paddr_t
+coremap_clock(struct addrspace **as, vaddr_t *va)
+{
+	struct coremap_entry *e;
+	int n, idx;
+
+	KASSERT(coremap_created);
+
+	for (n = 0; n < 2 * cm_nframes; n++) {
+		idx = cm_clockhand;
+		cm_clockhand = (cm_clockhand + 1) % cm_nframes;
+
+		e = &coremap[idx];
+		if (e->cme_as == NULL) {
+			continue;
+		}
+		if (e->cme_flags & CME_REF) {
+			e->cme_flags &= ~CME_REF;
+			continue;
+		}
+		KASSERT(e->cme_refcount == 1);
+		*as = e->cme_as;
+		*va = e->cme_vaddr;
+		return CM_PADDR(idx);
+	}
+	return 0;
+}
+
+int
+coremap_nframes(void)
+{
+	return cm_nframes;
+}
+
+void
+coremap_printstats(void)
+{
+	struct pcache *pc;
+	unsigned order, n, i, total;
+	int idx;
+
+	lock_acquire(coremap_lock);
+	kprintf("Coremap: %u/%d frames free\n", cm_nfree, cm_nframes);
+	for (order = 0; order <= CM_MAXORDER; order++) {
+		n = 0;
+		for (idx = cm_freelist[order]; idx != CM_NONE;
+		     idx = coremap[idx].cme_next) {
+			n++;
+		}
+		kprintf("   order %2u: %u free\n", order, n);
+	}
+	lock_release(coremap_lock);
+
+	kprintf("Per-cpu frame magazines:\n");
+	for (i = 0; i < npcaches; i++) {
+		pc = pcaches[i];
+		if (pc == NULL) {
+			continue;
+		}
+		/* Unlocked snapshot; these are just counters. */
+		total = pc->pc_hits + pc->pc_misses;
+		kprintf("   cpu%u: %u cached, %u/%u allocs hit (%u%%), "
+			"%u frees cached, %u drains\n",
+			i, pc->pc_count, pc->pc_hits, total,
+			total ? pc->pc_hits * 100 / total : 0,
+			pc->pc_frees, pc->pc_drains);
+	}
+}
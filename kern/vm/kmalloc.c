@@ -30,7 +30,11 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <kmalloc.h>
+#include <platform/maxcpus.h>
 
 /*
  * Kernel malloc.
@@ -71,9 +75,23 @@ fill_deadbeef(void *vptr, size_t len)
 //    sizes, and large numbers of items of the new size are allocated.
 //
 //    The free counts and addresses of the pages are maintained in
-//    another list.  Maintaining this table is a nuisance, because it
-//    cannot recursively use the subpage allocator. (We could probably
-//    make that work, but it would be painful.)
+//    pagerefs. Maintaining these is a nuisance, because they cannot
+//    recursively use the subpage allocator. (We could probably make
+//    that work, but it would be painful.)
+//
+//    Each size has a doubly linked list of the pages that still have
+//    free blocks, so allocating takes the head of the list, and a hash
+//    table keyed by page address finds the pageref of a block being
+//    freed. Neither depends on how many pages the heap has.
+//
+//    In front of all this, each cpu keeps a small magazine of free
+//    blocks per size (see kmalloc.h), so most kmalloc/kfree calls
+//    never touch the shared lists or kmalloc_spinlock at all. Finding
+//    the size of a block being freed uses the hash, which has its own
+//    striped locks for that purpose.
+//
+//    Kernel subsystems that allocate lots of one kind of object can
+//    use an object cache (slab.h) instead.
 //
 
 #undef  SLOW	/* consistency checks */
@@ -102,8 +120,9 @@ struct freelist {
 };
 
 struct pageref {
-	struct pageref *next_samesize;
-	struct pageref *next_all;
+	struct pageref *next_samesize;	/* pages of this size with free blocks */
+	struct pageref *prev_samesize;
+	struct pageref *next_hash;
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
@@ -115,84 +134,166 @@ struct pageref {
 #define PR_BLOCKTYPE(pr) ((pr)->pageaddr_and_blocktype & ~PAGE_FRAME)
 #define MKPAB(pa, blk)   (((pa)&PAGE_FRAME) | ((blk) & ~PAGE_FRAME))
 
+#define PR_HASHSIZE      1024
+#define PR_HASH(pa)      (((pa) / PAGE_SIZE) % PR_HASHSIZE)
+#define PR_NLOCKS        64
+#define PR_LOCK(pa)      (&prhash_locks[PR_HASH(pa) % PR_NLOCKS])
+
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
+ * Pagerefs come in page-sized chunks. The first chunk is in the
+ * kernel BSS, so kmalloc works before anything else is set up; more
+ * are allocated with alloc_kpages as the heap grows, and given back
+ * when they empty out again. One chunk covers about 800k of heap.
  *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
- *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * Dynamically allocated chunks are page-aligned, so a pageref's chunk
+ * is found by masking its address.
+ */
+
+#define PRC_NREFS ((PAGE_SIZE - 64) / sizeof(struct pageref))
+#define PRC_WORDS DIVROUNDUP(PRC_NREFS, 32)
+
+struct prchunk {
+	struct prchunk *next;
+	unsigned nfree;
+	uint32_t inuse[PRC_WORDS];
+	struct pageref refs[PRC_NREFS];
+};
+
+static struct prchunk prchunk0 = { NULL, PRC_NREFS, { 0 }, { { 0 } } };
+static struct prchunk *prchunks = &prchunk0;
+
+/* Pagerefs in all chunks, and how many of them are free. */
+static unsigned prtotal = PRC_NREFS;
+static unsigned prfree = PRC_NREFS;
+
+static
+struct prchunk *
+prchunk_of(struct pageref *p)
+{
+	if (p >= prchunk0.refs && p < prchunk0.refs + PRC_NREFS) {
+		return &prchunk0;
+	}
+	return (struct prchunk *)((vaddr_t)p & PAGE_FRAME);
+}
+
+/*
+ * Add a freshly allocated page to the pageref pool.
  */
+static
+void
+addprchunk(vaddr_t page)
+{
+	struct prchunk *c;
+	unsigned i;
 
-#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
+	COMPILE_ASSERT(sizeof(struct prchunk) <= PAGE_SIZE);
+	KASSERT(page % PAGE_SIZE == 0);
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+	c = (struct prchunk *)page;
+	c->nfree = PRC_NREFS;
+	for (i=0; i<PRC_WORDS; i++) {
+		c->inuse[i] = 0;
+	}
+	c->next = prchunks;
+	prchunks = c;
+	prtotal += PRC_NREFS;
+	prfree += PRC_NREFS;
+}
 
 static
 struct pageref *
 allocpageref(void)
 {
+	struct prchunk *c;
 	unsigned i,j;
 	uint32_t k;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
+	for (c = prchunks; c != NULL; c = c->next) {
+		if (c->nfree == 0) {
 			continue;
 		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
+		for (i=0; i<PRC_WORDS; i++) {
+			if (c->inuse[i]==0xffffffff) {
+				/* full */
+				continue;
 			}
+			for (k=1,j=0; k!=0 && i*32 + j < PRC_NREFS; k<<=1,j++) {
+				if ((c->inuse[i] & k)==0) {
+					c->inuse[i] |= k;
+					c->nfree--;
+					prfree--;
+					return &c->refs[i*32 + j];
+				}
+			}
+			/* only the last word can be partly past the end */
+			KASSERT(i == PRC_WORDS-1);
 		}
-		KASSERT(0);
+		panic("kmalloc: pageref chunk nfree count is wrong\n");
 	}
 
 	/* ran out */
 	return NULL;
 }
 
+/*
+ * Free a pageref. If that leaves its chunk empty and there are plenty
+ * of free pagerefs elsewhere, the chunk is unlinked and returned for
+ * the caller to free_kpages once kmalloc_spinlock is released;
+ * otherwise returns 0.
+ */
 static
-void
+vaddr_t
 freepageref(struct pageref *p)
 {
+	struct prchunk *c, **cp;
 	size_t i, j;
 	uint32_t k;
 
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
+	c = prchunk_of(p);
+	j = p - c->refs;
+	KASSERT(j < PRC_NREFS);  /* note: j is unsigned, don't test < 0 */
 	i = j/32;
 	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	KASSERT((c->inuse[i] & k) != 0);
+	c->inuse[i] &= ~k;
+	c->nfree++;
+	prfree++;
+
+	/* Keep half a chunk of slack so we don't thrash at the boundary. */
+	if (c == &prchunk0 || c->nfree < PRC_NREFS ||
+	    prfree - PRC_NREFS < PRC_NREFS/2) {
+		return 0;
+	}
+
+	for (cp = &prchunks; *cp != c; cp = &(*cp)->next) {
+		KASSERT(*cp != NULL);
+	}
+	*cp = c->next;
+	prtotal -= PRC_NREFS;
+	prfree -= PRC_NREFS;
+	return (vaddr_t)c;
 }
 
 ////////////////////////////////////////
 
 static struct pageref *sizebases[NSIZES];
-static struct pageref *allbase;
+static struct pageref *prhash[PR_HASHSIZE];
+
+/*
+ * Changing a hash chain needs both kmalloc_spinlock and the chain's
+ * lock here; looking something up needs either one.
+ */
+static struct spinlock prhash_locks[PR_NLOCKS] = {
+	[0 ... PR_NLOCKS-1] = SPINLOCK_INITIALIZER
+};
 
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the shared pool. The per-cpu magazines keep
+ * most traffic away from it.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -260,18 +361,24 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(pr->nfree > 0);
+			KASSERT(sc < prtotal);
 			sc++;
 		}
 	}
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
-		ac++;
+	for (i=0; i<PR_HASHSIZE; i++) {
+		for (pr = prhash[i]; pr != NULL; pr = pr->next_hash) {
+			checksubpage(pr);
+			KASSERT(PR_HASH(PR_PAGEADDR(pr)) == (unsigned)i);
+			KASSERT(ac < prtotal);
+			ac++;
+		}
 	}
 
-	KASSERT(sc==ac);
+	/* full pages are only in the hash */
+	KASSERT(sc<=ac);
+	KASSERT(ac == prtotal - prfree);
 }
 #else
 #define checksubpages() 
@@ -330,48 +437,236 @@ dumpsubpage(struct pageref *pr)
 	kprintf("\n");
 }
 
+static void kmag_printstats(void);
+
 void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	unsigned i;
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 
 	kprintf("Subpage allocator status:\n");
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		dumpsubpage(pr);
+	for (i=0; i<PR_HASHSIZE; i++) {
+		for (pr = prhash[i]; pr != NULL; pr = pr->next_hash) {
+			dumpsubpage(pr);
+		}
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	kmag_printstats();
 }
 
 ////////////////////////////////////////
 
+/*
+ * Put PR on, or take it off, the list of pages of its size that have
+ * free blocks.
+ */
 static
 void
-remove_lists(struct pageref *pr, int blktype)
+link_samesize(struct pageref *pr, int blktype)
 {
-	struct pageref **guy;
+	KASSERT(blktype>=0 && blktype<NSIZES);
+
+	pr->prev_samesize = NULL;
+	pr->next_samesize = sizebases[blktype];
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = pr;
+	}
+	sizebases[blktype] = pr;
+}
 
+static
+void
+unlink_samesize(struct pageref *pr, int blktype)
+{
 	KASSERT(blktype>=0 && blktype<NSIZES);
 
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_samesize;
-			break;
+	if (pr->prev_samesize != NULL) {
+		pr->prev_samesize->next_samesize = pr->next_samesize;
+	}
+	else {
+		KASSERT(sizebases[blktype] == pr);
+		sizebases[blktype] = pr->next_samesize;
+	}
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = pr->prev_samesize;
+	}
+	pr->next_samesize = pr->prev_samesize = NULL;
+}
+
+/*
+ * Find the pageref for the page containing PTRADDR, or NULL.
+ */
+static
+struct pageref *
+lookup_pageref(vaddr_t ptraddr)
+{
+	struct pageref *pr;
+	vaddr_t prpage;
+
+	prpage = ptraddr & PAGE_FRAME;
+	for (pr = prhash[PR_HASH(prpage)]; pr != NULL; pr = pr->next_hash) {
+		/* check for corruption */
+		KASSERT(PR_BLOCKTYPE(pr) < NSIZES);
+		checksubpage(pr);
+
+		if (PR_PAGEADDR(pr) == prpage) {
+			return pr;
 		}
 	}
+	return NULL;
+}
+
+static
+void
+remove_hash(struct pageref *pr)
+{
+	struct pageref **guy;
+	struct spinlock *lk;
 
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	lk = PR_LOCK(PR_PAGEADDR(pr));
+	spinlock_acquire(lk);
+	for (guy = &prhash[PR_HASH(PR_PAGEADDR(pr))]; *guy;
+	     guy = &(*guy)->next_hash) {
 		if (*guy == pr) {
-			*guy = pr->next_all;
+			*guy = pr->next_hash;
+			spinlock_release(lk);
+			return;
+		}
+	}
+	panic("kmalloc: pageref for 0x%lx not in hash\n",
+	      (unsigned long)PR_PAGEADDR(pr));
+}
+
+/*
+ * Return the block type of the subpage block at PTRADDR, or -1 if it
+ * isn't one. Doesn't need kmalloc_spinlock: the block is allocated,
+ * so its page and pageref can't go away under us.
+ */
+static
+int
+subpage_blktype(vaddr_t ptraddr)
+{
+	struct pageref *pr;
+	struct spinlock *lk;
+	vaddr_t prpage;
+	int blktype;
+
+	prpage = ptraddr & PAGE_FRAME;
+	lk = PR_LOCK(prpage);
+
+	blktype = -1;
+	spinlock_acquire(lk);
+	for (pr = prhash[PR_HASH(prpage)]; pr != NULL; pr = pr->next_hash) {
+		if (PR_PAGEADDR(pr) == prpage) {
+			blktype = PR_BLOCKTYPE(pr);
+			KASSERT(blktype < NSIZES);
 			break;
 		}
 	}
+	spinlock_release(lk);
+	return blktype;
+}
+
+/*
+ * Take a block off page PR, which must have one free.
+ */
+static
+void *
+subpage_pop(struct pageref *pr, unsigned blktype)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	void *retptr;		// our result
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(PR_BLOCKTYPE(pr) == blktype);
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+		/* full; back on the list when a block is freed */
+		unlink_samesize(pr, blktype);
+	}
+	return retptr;
+}
+
+/*
+ * Put the block at PTRADDR back on page PR. If that frees the whole
+ * page, the page is taken off the lists and returned, and *PRCPAGE is
+ * set to a page of pagerefs that can go too (or 0); the caller must
+ * free_kpages them once kmalloc_spinlock is released. Otherwise
+ * returns 0.
+ */
+static
+vaddr_t
+subpage_push(struct pageref *pr, vaddr_t ptraddr, vaddr_t *prcpage)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	offset = ptraddr - prpage;
+	KASSERT(offset < PAGE_SIZE && offset % sizes[blktype] == 0);
+
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
+
+	fla = prpage + offset;
+	fl = (struct freelist *)fla;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+		/* was full, so it wasn't on the list */
+		link_samesize(pr, blktype);
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	*prcpage = 0;
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+		/* Whole page is free. */
+		unlink_samesize(pr, blktype);
+		remove_hash(pr);
+		*prcpage = freepageref(pr);
+		return prpage;
+	}
+	return 0;
 }
 
 static
@@ -399,6 +694,7 @@ subpage_kmalloc(size_t sz)
 	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t prcpage;	// new page of pagerefs, if needed
 	vaddr_t fla;		// free list entry address
 	struct freelist *volatile fl;	// free list entry
 	void *retptr;		// our result
@@ -413,41 +709,23 @@ subpage_kmalloc(size_t sz)
 
 	checksubpages();
 
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+	/* Every page on the list has a free block. */
+	pr = sizebases[blktype];
+	if (pr != NULL) {
 
 		/* check for corruption */
 		KASSERT(PR_BLOCKTYPE(pr) == blktype);
 		checksubpage(pr);
+		KASSERT(pr->nfree > 0);
 
-		if (pr->nfree > 0) {
+	doalloc: /* comes here after getting a whole fresh page */
 
-		doalloc: /* comes here after getting a whole fresh page */
+		retptr = subpage_pop(pr, blktype);
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
+		checksubpages();
 
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
-
-			checksubpages();
-
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
-		}
+		spinlock_release(&kmalloc_spinlock);
+		return retptr;
 	}
 
 	/*
@@ -469,6 +747,19 @@ subpage_kmalloc(size_t sz)
 	spinlock_acquire(&kmalloc_spinlock);
 
 	pr = allocpageref();
+	if (pr==NULL) {
+		/*
+		 * Out of pagerefs; get another chunk of them, again
+		 * without the spinlock. Someone else may add one too.
+		 */
+		spinlock_release(&kmalloc_spinlock);
+		prcpage = alloc_kpages(1);
+		spinlock_acquire(&kmalloc_spinlock);
+		if (prcpage != 0) {
+			addprchunk(prcpage);
+			pr = allocpageref();
+		}
+	}
 	if (pr==NULL) {
 		/* Couldn't allocate accounting space for the new page. */
 		spinlock_release(&kmalloc_spinlock);
@@ -498,11 +789,12 @@ subpage_kmalloc(size_t sz)
 	pr->freelist_offset = fla - prpage;
 	KASSERT(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
 
-	pr->next_samesize = sizebases[blktype];
-	sizebases[blktype] = pr;
+	link_samesize(pr, blktype);
 
-	pr->next_all = allbase;
-	allbase = pr;
+	spinlock_acquire(PR_LOCK(prpage));
+	pr->next_hash = prhash[PR_HASH(prpage)];
+	prhash[PR_HASH(prpage)] = pr;
+	spinlock_release(PR_LOCK(prpage));
 
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
@@ -516,9 +808,9 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
+	vaddr_t freepage;	// emptied page, to free
+	vaddr_t prcpage;	// emptied page of pagerefs, to free
 
 	ptraddr = (vaddr_t)ptr;
 
@@ -526,24 +818,14 @@ subpage_kfree(void *ptr)
 
 	checksubpages();
 
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = lookup_pageref(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
 		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
 
 	offset = ptraddr - prpage;
 
@@ -558,32 +840,15 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef(ptr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
-
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
-	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
+	freepage = subpage_push(pr, ptraddr, &prcpage);
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+	/* Call free_kpages without kmalloc_spinlock. */
+	spinlock_release(&kmalloc_spinlock);
+	if (freepage != 0) {
+		free_kpages(freepage);
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+	if (prcpage != 0) {
+		free_kpages(prcpage);
 	}
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
@@ -595,40 +860,307 @@ subpage_kfree(void *ptr)
 	return 0;
 }
 
+//
+////////////////////////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+// Like the page frame magazines in the coremap, a magazine is only
+// touched under its own spinlock, which also keeps us from being
+// preempted halfway through. Using another cpu's magazine after
+// migrating is merely slower, never wrong.
+
+static struct kmag *kmags[MAXCPUS];
+static unsigned nkmags;
+
+void
+kmag_init(struct kmag *km, unsigned cpunum)
+{
+	unsigned i;
+
+	COMPILE_ASSERT(KMAG_NSIZES == NSIZES);
+	KASSERT(cpunum < MAXCPUS);
+
+	spinlock_init(&km->km_lock);
+	for (i=0; i<KMAG_NSIZES; i++) {
+		km->km_count[i] = 0;
+	}
+	km->km_hits = 0;
+	km->km_misses = 0;
+	km->km_frees = 0;
+	km->km_flushes = 0;
+
+	kmags[cpunum] = km;
+	if (cpunum >= nkmags) {
+		nkmags = cpunum + 1;
+	}
+}
+
+/*
+ * Take up to N free blocks of type BLKTYPE from the shared pool
+ * without adding pages to it.
+ */
+static
+unsigned
+subpage_getbatch(unsigned blktype, void **blocks, unsigned n)
+{
+	unsigned got;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	for (got = 0; got < n && sizebases[blktype] != NULL; got++) {
+		blocks[got] = subpage_pop(sizebases[blktype], blktype);
+	}
+	spinlock_release(&kmalloc_spinlock);
+	return got;
+}
+
+/*
+ * Return N blocks, already filled with deadbeef, to the shared pool.
+ * Returns the number of pages that freed.
+ */
+static
+unsigned
+subpage_putbatch(void **blocks, unsigned n)
+{
+	vaddr_t freepages[2*KMAG_BATCH];
+	struct pageref *pr;
+	vaddr_t page, prcpage;
+	unsigned i, nfree;
+
+	KASSERT(n <= KMAG_BATCH);
+
+	nfree = 0;
+	spinlock_acquire(&kmalloc_spinlock);
+	for (i=0; i<n; i++) {
+		pr = lookup_pageref((vaddr_t)blocks[i]);
+		KASSERT(pr != NULL);
+		page = subpage_push(pr, (vaddr_t)blocks[i], &prcpage);
+		if (page != 0) {
+			freepages[nfree++] = page;
+		}
+		if (prcpage != 0) {
+			freepages[nfree++] = prcpage;
+		}
+	}
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+
+	for (i=0; i<nfree; i++) {
+		free_kpages(freepages[i]);
+	}
+	return nfree;
+}
+
+static
+void *
+kmag_get(unsigned blktype)
+{
+	struct kmag *km;
+	void *blocks[KMAG_BATCH];
+	void *ret;
+	unsigned i, n;
+
+	km = &curcpu->c_kmag;
+
+	spinlock_acquire(&km->km_lock);
+	if (km->km_count[blktype] > 0) {
+		ret = km->km_blocks[blktype][--km->km_count[blktype]];
+		km->km_hits++;
+		spinlock_release(&km->km_lock);
+		return ret;
+	}
+	km->km_misses++;
+	spinlock_release(&km->km_lock);
+
+	/* Empty; refill a batch with one trip through kmalloc_spinlock. */
+	n = subpage_getbatch(blktype, blocks, KMAG_BATCH);
+	if (n == 0) {
+		/* The pool needs a new page; let subpage_kmalloc get it. */
+		return NULL;
+	}
+
+	/* Keep blocks[0] for the caller; stash the rest. */
+	spinlock_acquire(&km->km_lock);
+	for (i = 1; i < n && km->km_count[blktype] < KMAG_SIZE; i++) {
+		km->km_blocks[blktype][km->km_count[blktype]++] = blocks[i];
+	}
+	spinlock_release(&km->km_lock);
+
+	/* Someone else refilled it while we were away. */
+	if (i < n) {
+		subpage_putbatch(&blocks[i], n - i);
+	}
+
+	return blocks[0];
+}
+
+static
+void
+kmag_put(void *ptr, unsigned blktype)
+{
+	struct kmag *km;
+	void *blocks[KMAG_BATCH];
+	unsigned n;
+
+	km = &curcpu->c_kmag;
+
+	spinlock_acquire(&km->km_lock);
+	if (km->km_count[blktype] < KMAG_SIZE) {
+		km->km_blocks[blktype][km->km_count[blktype]++] = ptr;
+		km->km_frees++;
+		spinlock_release(&km->km_lock);
+		return;
+	}
+
+	/* Full; send this block and a batch of others back. */
+	blocks[0] = ptr;
+	for (n = 1; n < KMAG_BATCH; n++) {
+		blocks[n] = km->km_blocks[blktype][--km->km_count[blktype]];
+	}
+	km->km_flushes++;
+	spinlock_release(&km->km_lock);
+
+	subpage_putbatch(blocks, n);
+}
+
+/*
+ * Give every cpu's cached blocks back to the shared pool, so that
+ * pages they were keeping alive can be freed. Called when memory runs
+ * out, before anything more expensive is tried.
+ */
+bool
+kmag_drain(void)
+{
+	struct kmag *km;
+	void *blocks[KMAG_BATCH];
+	unsigned i, j, n, nfreed;
+
+	nfreed = 0;
+	for (i = 0; i < nkmags; i++) {
+		km = kmags[i];
+		if (km == NULL) {
+			continue;
+		}
+		for (j = 0; j < KMAG_NSIZES; j++) {
+			do {
+				spinlock_acquire(&km->km_lock);
+				for (n = 0; n < KMAG_BATCH &&
+					     km->km_count[j] > 0; n++) {
+					blocks[n] = km->km_blocks[j]
+						[--km->km_count[j]];
+				}
+				spinlock_release(&km->km_lock);
+				if (n > 0) {
+					nfreed += subpage_putbatch(blocks, n);
+				}
+			} while (n == KMAG_BATCH);
+		}
+	}
+	return nfreed > 0;
+}
+
+static
+void
+kmag_printstats(void)
+{
+	struct kmag *km;
+	unsigned i, j, total, cached;
+
+	kprintf("Per-cpu kmalloc magazines:\n");
+	for (i = 0; i < nkmags; i++) {
+		km = kmags[i];
+		if (km == NULL) {
+			continue;
+		}
+		/* Unlocked snapshot; these are just counters. */
+		cached = 0;
+		for (j = 0; j < KMAG_NSIZES; j++) {
+			cached += km->km_count[j];
+		}
+		total = km->km_hits + km->km_misses;
+		kprintf("   cpu%u: %u cached, %u/%u allocs hit (%u%%), "
+			"%u frees cached, %u flushes\n",
+			i, cached, km->km_hits, total,
+			total ? km->km_hits * 100 / total : 0,
+			km->km_frees, km->km_flushes);
+	}
+}
+
 //
 ////////////////////////////////////////////////////////////
 
 void *
 kmalloc(size_t sz)
 {
+	void *ptr;
+	size_t charged;		// what the block really costs
+
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
-		vaddr_t address;
 
 		/* Round up to a whole number of pages. */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
-		address = alloc_kpages(npages);
-		if (address==0) {
-			return NULL;
-		}
+		ptr = (void *)alloc_kpages(npages);
+		charged = npages * PAGE_SIZE;
+	}
+	else {
+		int blktype;
+
+		blktype = blocktype(sz);
+		charged = sizes[blktype];
 
-		return (void *)address;
+		/* No curcpu means early boot; go straight to the pool. */
+		ptr = NULL;
+		if (CURCPU_EXISTS()) {
+			ptr = kmag_get(blktype);
+		}
+		if (ptr == NULL) {
+			ptr = subpage_kmalloc(sz);
+		}
 	}
 
-	return subpage_kmalloc(sz);
+#if OPT_KMPROF
+	if (ptr != NULL) {
+		kmprof_alloc(ptr, charged, __builtin_return_address(0));
+	}
+#else
+	(void)charged;
+#endif
+	return ptr;
 }
 
 void
 kfree(void *ptr)
 {
+	vaddr_t ptraddr = (vaddr_t)ptr;
+	int blktype;
+
+	if (ptr == NULL) {
+		return;
+	}
+
+#if OPT_KMPROF
+	kmprof_free(ptr);
+#endif
+
 	/*
 	 * Try subpage first; if that fails, assume it's a big allocation.
 	 */
-	if (ptr == NULL) {
-		return;
-	} else if (subpage_kfree(ptr)) {
-		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
-		free_kpages((vaddr_t)ptr);
+	blktype = subpage_blktype(ptraddr);
+	if (blktype < 0) {
+		KASSERT(ptraddr%PAGE_SIZE==0);
+		free_kpages(ptraddr);
+	}
+	else if (CURCPU_EXISTS()) {
+		if ((ptraddr & ~PAGE_FRAME) % sizes[blktype] != 0) {
+			panic("kfree: subpage free of invalid addr %p\n", ptr);
+		}
+		fill_deadbeef(ptr, sizes[blktype]);
+		kmag_put(ptr, blktype);
+	}
+	else {
+		subpage_kfree(ptr);
 	}
 }
 
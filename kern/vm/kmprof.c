@@ -0,0 +1,267 @@
+/*
+ * kmalloc profiler, built with "options kmprof".
+ *
+ * Every kmalloc is charged to its call site (the return address of
+ * the call to kmalloc) and every kfree credited back to whichever
+ * site allocated the block, so the kmprof menu command can show who
+ * holds the kernel heap and who churns it.
+ *
+ * Live blocks are remembered in a hash table keyed by address. Its
+ * entries come from whole pages taken with alloc_kpages, never from
+ * kmalloc itself, and are recycled but never given back. If no page
+ * can be had, the block goes untracked and is only counted.
+ *
+ * Sizes are charged by size class (what the block really costs), not
+ * by what the caller asked for.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <clock.h>
+#include <vm.h>
+#include <kmalloc.h>
+
+#define KMPROF_NSITES   256	/* distinct call sites tracked */
+#define KMPROF_HASHSIZE 1024	/* buckets for live blocks */
+#define KMPROF_TOP      10	/* sites shown per list */
+
+struct kmsite {
+	const void *ks_caller;		/* NULL if the slot is unused */
+	unsigned ks_allocs;
+	unsigned ks_frees;
+	size_t ks_livebytes;
+	unsigned ks_lastallocs;		/* ks_allocs at the last report */
+};
+
+struct kmblock {
+	vaddr_t kb_addr;
+	size_t kb_size;
+	struct kmsite *kb_site;
+	struct kmblock *kb_next;
+};
+
+static struct spinlock kmprof_lock = SPINLOCK_INITIALIZER;
+static struct kmsite kmsites[KMPROF_NSITES];
+static struct kmsite kmsite_other;	/* when kmsites is full */
+static struct kmblock *kmblocks[KMPROF_HASHSIZE];
+static struct kmblock *kmblock_free;
+static unsigned kmprof_untracked;
+
+/* When the last report was printed, for allocation rates. */
+static time_t kmprof_lastsecs;
+static uint32_t kmprof_lastnsecs;
+
+#define KMB_HASH(addr)  (((addr) >> 4) % KMPROF_HASHSIZE)
+
+/*
+ * Find or claim the slot for CALLER. Open addressing; once the table
+ * fills up, new sites are lumped together in kmsite_other.
+ */
+static
+struct kmsite *
+kmprof_site(const void *caller)
+{
+	unsigned i, n;
+
+	i = ((uintptr_t)caller >> 2) % KMPROF_NSITES;
+	for (n = 0; n < KMPROF_NSITES; n++) {
+		if (kmsites[i].ks_caller == caller) {
+			return &kmsites[i];
+		}
+		if (kmsites[i].ks_caller == NULL) {
+			kmsites[i].ks_caller = caller;
+			return &kmsites[i];
+		}
+		i = (i + 1) % KMPROF_NSITES;
+	}
+	return &kmsite_other;
+}
+
+/*
+ * Get a page of kmblocks. Called without kmprof_lock, since
+ * alloc_kpages may sleep.
+ */
+static
+void
+kmprof_morekmblocks(void)
+{
+	struct kmblock *kb;
+	vaddr_t page;
+	unsigned i;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return;
+	}
+	kb = (struct kmblock *)page;
+
+	spinlock_acquire(&kmprof_lock);
+	for (i = 0; i < PAGE_SIZE / sizeof(struct kmblock); i++) {
+		kb[i].kb_next = kmblock_free;
+		kmblock_free = &kb[i];
+	}
+	spinlock_release(&kmprof_lock);
+}
+
+void
+kmprof_alloc(void *ptr, size_t size, const void *caller)
+{
+	struct kmsite *ks;
+	struct kmblock *kb;
+	unsigned b;
+
+	if (kmblock_free == NULL) {
+		kmprof_morekmblocks();
+	}
+
+	spinlock_acquire(&kmprof_lock);
+	ks = kmprof_site(caller);
+	ks->ks_allocs++;
+
+	kb = kmblock_free;
+	if (kb == NULL) {
+		kmprof_untracked++;
+		spinlock_release(&kmprof_lock);
+		return;
+	}
+	kmblock_free = kb->kb_next;
+
+	kb->kb_addr = (vaddr_t)ptr;
+	kb->kb_size = size;
+	kb->kb_site = ks;
+	b = KMB_HASH(kb->kb_addr);
+	kb->kb_next = kmblocks[b];
+	kmblocks[b] = kb;
+	ks->ks_livebytes += size;
+	spinlock_release(&kmprof_lock);
+}
+
+void
+kmprof_free(void *ptr)
+{
+	struct kmblock *kb, **kbp;
+
+	spinlock_acquire(&kmprof_lock);
+	for (kbp = &kmblocks[KMB_HASH((vaddr_t)ptr)]; (kb = *kbp) != NULL;
+	     kbp = &kb->kb_next) {
+		if (kb->kb_addr == (vaddr_t)ptr) {
+			*kbp = kb->kb_next;
+			kb->kb_site->ks_frees++;
+			kb->kb_site->ks_livebytes -= kb->kb_size;
+			kb->kb_next = kmblock_free;
+			kmblock_free = kb;
+			break;
+		}
+	}
+	/* Not found: allocated while untracked. */
+	spinlock_release(&kmprof_lock);
+}
+
+/*
+ * Fill TOP with the KMPROF_TOP sites with the largest KEY, best
+ * first, and return how many there are.
+ */
+static
+unsigned
+kmprof_top(struct kmsite **top, unsigned (*key)(const struct kmsite *))
+{
+	struct kmsite *ks;
+	unsigned i, j, n;
+
+	n = 0;
+	for (i = 0; i <= KMPROF_NSITES; i++) {
+		ks = i < KMPROF_NSITES ? &kmsites[i] : &kmsite_other;
+		if (ks->ks_allocs == 0 || key(ks) == 0) {
+			continue;
+		}
+		/* Insertion into a short sorted list. */
+		for (j = n; j > 0 && key(top[j-1]) < key(ks); j--) {
+			if (j < KMPROF_TOP) {
+				top[j] = top[j-1];
+			}
+		}
+		if (j < KMPROF_TOP) {
+			top[j] = ks;
+			if (n < KMPROF_TOP) {
+				n++;
+			}
+		}
+	}
+	return n;
+}
+
+static
+unsigned
+kmprof_livekey(const struct kmsite *ks)
+{
+	return ks->ks_livebytes;
+}
+
+static
+unsigned
+kmprof_ratekey(const struct kmsite *ks)
+{
+	return ks->ks_allocs - ks->ks_lastallocs;
+}
+
+static
+void
+kmprof_printsite(const struct kmsite *ks, unsigned ms)
+{
+	unsigned recent;
+
+	recent = ks->ks_allocs - ks->ks_lastallocs;
+	if (ks == &kmsite_other) {
+		kprintf("   (other)   ");
+	}
+	else {
+		kprintf("   %p", ks->ks_caller);
+	}
+	kprintf(" %8lu live bytes  %7u blocks  %8u allocs  %6u/s\n",
+		(unsigned long)ks->ks_livebytes, ks->ks_allocs - ks->ks_frees,
+		ks->ks_allocs, ms ? (unsigned)((uint64_t)recent * 1000 / ms) : 0);
+}
+
+void
+kmprof_printstats(void)
+{
+	struct kmsite *bylive[KMPROF_TOP], *byrate[KMPROF_TOP];
+	time_t secs, dsecs;
+	uint32_t nsecs, dnsecs;
+	unsigned i, nlive, nrate, ms;
+
+	gettime(&secs, &nsecs);
+	getinterval(kmprof_lastsecs, kmprof_lastnsecs, secs, nsecs,
+		    &dsecs, &dnsecs);
+	ms = dsecs * 1000 + dnsecs / 1000000;
+
+	spinlock_acquire(&kmprof_lock);
+	nlive = kmprof_top(bylive, kmprof_livekey);
+	nrate = kmprof_top(byrate, kmprof_ratekey);
+
+	kprintf("kmalloc call sites by live bytes:\n");
+	for (i = 0; i < nlive; i++) {
+		kmprof_printsite(bylive[i], ms);
+	}
+	kprintf("kmalloc call sites by allocations in the last %u.%03u s:\n",
+		ms / 1000, ms % 1000);
+	for (i = 0; i < nrate; i++) {
+		kmprof_printsite(byrate[i], ms);
+	}
+	if (kmprof_untracked > 0) {
+		kprintf("   (%u allocations not tracked for lack of memory)\n",
+			kmprof_untracked);
+	}
+
+	/* Start the next rate interval. */
+	for (i = 0; i < KMPROF_NSITES; i++) {
+		kmsites[i].ks_lastallocs = kmsites[i].ks_allocs;
+	}
+	kmsite_other.ks_lastallocs = kmsite_other.ks_allocs;
+	kmprof_lastsecs = secs;
+	kmprof_lastnsecs = nsecs;
+	spinlock_release(&kmprof_lock);
+
+	kprintf("Use os161-addr2line on the kernel to name the sites.\n");
+}
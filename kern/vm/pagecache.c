@@ -0,0 +1,409 @@
+/*
+ * Page cache for shared file mappings. See pagecache.h.
+ *
+ * Entries live in a fixed hash table keyed by (vnode, offset). Each
+ * entry holds a reference to its vnode so the file can't go away
+ * while pages of it are cached.
+ *
+ * pc_lock covers the table and the entries, and is never held across
+ * I/O or vnode reference changes, which take vfs_biglock. An entry
+ * being read or written is marked busy instead; it stays in the table,
+ * and anyone else who needs it waits on pc_cv.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <vnode.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagecache.h>
+
+#define PC_HASHSIZE 128
+
+struct pcentry {
+	struct vnode *pe_vn;
+	off_t pe_offset;
+	paddr_t pe_pa;
+	bool pe_dirty;
+	bool pe_busy;		/* I/O in progress; don't reclaim */
+	struct pcentry *pe_next;
+};
+
+static struct lock *pc_lock;
+static struct cv *pc_cv;		/* a busy entry is done */
+static struct pcentry *pc_hash[PC_HASHSIZE];
+static unsigned pc_hand;		/* next bucket pagecache_reclaim tries */
+
+static
+unsigned
+pc_bucket(struct vnode *vn, off_t offset)
+{
+	return (((uintptr_t)vn >> 4) ^ (unsigned)(offset / PAGE_SIZE))
+		% PC_HASHSIZE;
+}
+
+static
+struct pcentry *
+pc_find(struct vnode *vn, off_t offset)
+{
+	struct pcentry *pe;
+
+	for (pe = pc_hash[pc_bucket(vn, offset)]; pe != NULL;
+	     pe = pe->pe_next) {
+		if (pe->pe_vn == vn && pe->pe_offset == offset) {
+			return pe;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Find the entry for VN at OFFSET, waiting out any I/O on it.
+ */
+static
+struct pcentry *
+pc_find_idle(struct vnode *vn, off_t offset)
+{
+	struct pcentry *pe;
+
+	KASSERT(lock_do_i_hold(pc_lock));
+
+	while ((pe = pc_find(vn, offset)) != NULL && pe->pe_busy) {
+		cv_wait(pc_cv, pc_lock);
+	}
+	return pe;
+}
+
+/*
+ * Move one page between the frame and the file. Only the part of the
+ * page inside the file is transferred: a short read leaves the rest
+ * of the (zeroed) frame alone, and writes never extend the file.
+ *
+ * The caller has marked the entry busy and doesn't hold pc_lock.
+ */
+static
+int
+pc_io(struct pcentry *pe, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	struct stat st;
+	size_t len;
+	int result;
+
+	len = PAGE_SIZE;
+	if (rw == UIO_WRITE) {
+		result = VOP_STAT(pe->pe_vn, &st);
+		if (result) {
+			return result;
+		}
+		if (st.st_size <= pe->pe_offset) {
+			return 0;
+		}
+		if (st.st_size - pe->pe_offset < PAGE_SIZE) {
+			len = st.st_size - pe->pe_offset;
+		}
+	}
+
+	KASSERT(pe->pe_busy);
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(pe->pe_pa), len,
+		  pe->pe_offset, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(pe->pe_vn, &ku);
+	}
+	else {
+		result = VOP_WRITE(pe->pe_vn, &ku);
+	}
+	return result;
+}
+
+/*
+ * Take pc_lock back after I/O on PE and let its waiters at it.
+ */
+static
+void
+pc_unbusy(struct pcentry *pe)
+{
+	lock_acquire(pc_lock);
+	KASSERT(pe->pe_busy);
+	pe->pe_busy = false;
+	cv_broadcast(pc_cv, pc_lock);
+}
+
+/*
+ * Take PE out of its bucket.
+ */
+static
+void
+pc_unlink(struct pcentry *pe)
+{
+	struct pcentry **pep;
+
+	KASSERT(lock_do_i_hold(pc_lock));
+
+	for (pep = &pc_hash[pc_bucket(pe->pe_vn, pe->pe_offset)];
+	     *pep != pe; pep = &(*pep)->pe_next) {
+		KASSERT(*pep != NULL);
+	}
+	*pep = pe->pe_next;
+}
+
+void
+pagecache_bootstrap(void)
+{
+	pc_lock = lock_create("pagecache");
+	pc_cv = cv_create("pagecache");
+	if (pc_lock == NULL || pc_cv == NULL) {
+		panic("pagecache_bootstrap: out of memory\n");
+	}
+}
+
+int
+pagecache_get(struct vnode *vn, off_t offset, paddr_t *pa, bool *fromdisk)
+{
+	struct pcentry *pe, *newpe;
+	unsigned b;
+	int result;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	lock_acquire(pc_lock);
+	pe = pc_find_idle(vn, offset);
+	if (pe != NULL) {
+		coremap_incref(pe->pe_pa);
+		*pa = pe->pe_pa;
+		lock_release(pc_lock);
+		*fromdisk = false;
+		return 0;
+	}
+	lock_release(pc_lock);
+
+	/* Making room may reclaim cached pages, so do it unlocked. */
+	newpe = kmalloc(sizeof(struct pcentry));
+	if (newpe == NULL) {
+		return ENOMEM;
+	}
+	newpe->pe_pa = vm_getframes(1);
+	if (newpe->pe_pa == 0) {
+		kfree(newpe);
+		return ENOMEM;
+	}
+	bzero((void *)PADDR_TO_KVADDR(newpe->pe_pa), PAGE_SIZE);
+	newpe->pe_vn = vn;
+	newpe->pe_offset = offset;
+	newpe->pe_dirty = false;
+	newpe->pe_busy = true;
+	VOP_INCREF(vn);
+
+	lock_acquire(pc_lock);
+	pe = pc_find_idle(vn, offset);
+	if (pe != NULL) {
+		/* Someone else read it in meanwhile; use theirs. */
+		coremap_incref(pe->pe_pa);
+		*pa = pe->pe_pa;
+		lock_release(pc_lock);
+		coremap_decref(newpe->pe_pa);
+		VOP_DECREF(vn);
+		kfree(newpe);
+		*fromdisk = false;
+		return 0;
+	}
+
+	/* In the table, but busy, while we read it. */
+	b = pc_bucket(vn, offset);
+	newpe->pe_next = pc_hash[b];
+	pc_hash[b] = newpe;
+	lock_release(pc_lock);
+
+	pe = newpe;
+	result = pc_io(pe, UIO_READ);
+	pc_unbusy(pe);
+	if (result) {
+		pc_unlink(pe);
+		lock_release(pc_lock);
+		coremap_decref(pe->pe_pa);
+		VOP_DECREF(vn);
+		kfree(pe);
+		return result;
+	}
+	coremap_incref(pe->pe_pa);
+	*pa = pe->pe_pa;
+	lock_release(pc_lock);
+	*fromdisk = true;
+	return 0;
+}
+
+void
+pagecache_markdirty(struct vnode *vn, off_t offset)
+{
+	struct pcentry *pe;
+
+	/* It is mapped, so it can't be reclaimed; it may be busy. */
+	lock_acquire(pc_lock);
+	pe = pc_find(vn, offset);
+	KASSERT(pe != NULL);
+	pe->pe_dirty = true;
+	lock_release(pc_lock);
+}
+
+int
+pagecache_flush(struct vnode *vn, off_t start, off_t end)
+{
+	struct pcentry *pe, *next;
+	unsigned b;
+	int result, err;
+
+	err = 0;
+	lock_acquire(pc_lock);
+	for (b = 0; b < PC_HASHSIZE; b++) {
+ restart:
+		for (pe = pc_hash[b]; pe != NULL; pe = next) {
+			next = pe->pe_next;
+			if (pe->pe_vn != vn ||
+			    pe->pe_offset < start || pe->pe_offset >= end) {
+				continue;
+			}
+			if (pe->pe_busy) {
+				/* Its data may be newer than what's going out. */
+				cv_wait(pc_cv, pc_lock);
+				goto restart;
+			}
+			if (!pe->pe_dirty) {
+				continue;
+			}
+
+			/* Busy entries stay put, so PE is still here after. */
+			pe->pe_busy = true;
+			lock_release(pc_lock);
+			result = pc_io(pe, UIO_WRITE);
+			pc_unbusy(pe);
+			next = pe->pe_next;
+			if (result) {
+				err = result;
+				continue;
+			}
+			if (coremap_refcount(pe->pe_pa) == 1) {
+				pe->pe_dirty = false;
+			}
+		}
+	}
+	lock_release(pc_lock);
+	return err;
+}
+
+int
+pagecache_prewrite(struct vnode *vn, off_t start, off_t end)
+{
+	struct pcentry *pe;
+	off_t offset;
+	int result, err;
+
+	err = 0;
+	lock_acquire(pc_lock);
+	for (offset = start - start % PAGE_SIZE; offset < end;
+	     offset += PAGE_SIZE) {
+		pe = pc_find_idle(vn, offset);
+		if (pe == NULL || !pe->pe_dirty) {
+			continue;
+		}
+		pe->pe_busy = true;
+		lock_release(pc_lock);
+		result = pc_io(pe, UIO_WRITE);
+		pc_unbusy(pe);
+		if (result) {
+			err = result;
+			continue;
+		}
+		if (coremap_refcount(pe->pe_pa) == 1) {
+			pe->pe_dirty = false;
+		}
+	}
+	lock_release(pc_lock);
+	return err;
+}
+
+void
+pagecache_postwrite(struct vnode *vn, off_t start, off_t end)
+{
+	struct pcentry *pe;
+	off_t offset;
+
+	lock_acquire(pc_lock);
+	for (offset = start - start % PAGE_SIZE; offset < end;
+	     offset += PAGE_SIZE) {
+		pe = pc_find_idle(vn, offset);
+		if (pe == NULL) {
+			continue;
+		}
+		if (coremap_refcount(pe->pe_pa) == 1) {
+			/* Nobody maps it; the next fault reads it afresh. */
+			pc_unlink(pe);
+			lock_release(pc_lock);
+			coremap_decref(pe->pe_pa);
+			VOP_DECREF(pe->pe_vn);
+			kfree(pe);
+			lock_acquire(pc_lock);
+			continue;
+		}
+
+		/*
+		 * Mapped: refresh the frame so its mappers see the write.
+		 * If the read fails they keep the old data, as they would
+		 * have anyway.
+		 */
+		pe->pe_busy = true;
+		lock_release(pc_lock);
+		(void)pc_io(pe, UIO_READ);
+		pc_unbusy(pe);
+	}
+	lock_release(pc_lock);
+}
+
+bool
+pagecache_reclaim(void)
+{
+	struct pcentry *pe;
+	unsigned n, b;
+	int result;
+
+	lock_acquire(pc_lock);
+	for (n = 0; n < PC_HASHSIZE; n++) {
+		b = pc_hand;
+		pc_hand = (pc_hand + 1) % PC_HASHSIZE;
+
+		for (pe = pc_hash[b]; pe != NULL; pe = pe->pe_next) {
+			/*
+			 * Only pagecache_get adds mappings of an
+			 * unmapped page, and it waits for busy ones.
+			 */
+			if (pe->pe_busy || coremap_refcount(pe->pe_pa) > 1) {
+				continue;
+			}
+			if (pe->pe_dirty) {
+				pe->pe_busy = true;
+				lock_release(pc_lock);
+				result = pc_io(pe, UIO_WRITE);
+				pc_unbusy(pe);
+				if (result) {
+					/* Can't save it; keep it. */
+					continue;
+				}
+				pe->pe_dirty = false;
+			}
+			KASSERT(coremap_refcount(pe->pe_pa) == 1);
+			pc_unlink(pe);
+			lock_release(pc_lock);
+
+			coremap_decref(pe->pe_pa);
+			VOP_DECREF(pe->pe_vn);
+			kfree(pe);
+			return true;
+		}
+	}
+	lock_release(pc_lock);
+	return false;
+}
@@ -0,0 +1,154 @@
+/*
+ * Two-level page tables. See pagetable.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <swap.h>
+
+#define PT_L2_ENTRIES  (PAGE_SIZE / sizeof(pte_t))
+#define PT_L1_ENTRIES  (USERSPACETOP / (PT_L2_ENTRIES * PAGE_SIZE))
+
+#define PT_L1_INDEX(va)  ((va) >> 22)
+#define PT_L2_INDEX(va)  (((va) >> 12) & (PT_L2_ENTRIES - 1))
+#define PT_VADDR(i, j)   (((vaddr_t)(i) << 22) | ((vaddr_t)(j) << 12))
+
+struct pagetable {
+	pte_t *pt_dir[PT_L1_ENTRIES];
+};
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+	unsigned i;
+
+	pt = kmalloc(sizeof(struct pagetable));
+	if (pt == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < PT_L1_ENTRIES; i++) {
+		pt->pt_dir[i] = NULL;
+	}
+	return pt;
+}
+
+/*
+ * Let go of whatever backs PTE: its frame or its swap slot.
+ */
+static
+void
+pte_release(pte_t pte)
+{
+	if (pte & PTE_VALID) {
+		coremap_decref(PTE_PADDR(pte));
+	}
+	else if (pte & PTE_SWAPPED) {
+		swap_free(PTE_SWAPSLOT(pte));
+	}
+}
+
+void
+pt_destroy(struct pagetable *pt)
+{
+	unsigned i, j;
+	pte_t *l2;
+
+	for (i = 0; i < PT_L1_ENTRIES; i++) {
+		l2 = pt->pt_dir[i];
+		if (l2 == NULL) {
+			continue;
+		}
+		for (j = 0; j < PT_L2_ENTRIES; j++) {
+			pte_release(l2[j]);
+		}
+		kfree(l2);
+	}
+	kfree(pt);
+}
+
+void
+pt_clear(struct pagetable *pt, vaddr_t va)
+{
+	pte_t *pte;
+
+	pte = pt_lookup(pt, va, false);
+	if (pte == NULL) {
+		return;
+	}
+	pte_release(*pte);
+	*pte = 0;
+}
+
+pte_t *
+pt_lookup(struct pagetable *pt, vaddr_t va, bool create)
+{
+	pte_t *l2;
+	unsigned i;
+
+	KASSERT(va < USERSPACETOP);
+
+	i = PT_L1_INDEX(va);
+	l2 = pt->pt_dir[i];
+	if (l2 == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		l2 = kmalloc(PAGE_SIZE);
+		if (l2 == NULL) {
+			return NULL;
+		}
+		bzero(l2, PAGE_SIZE);
+		pt->pt_dir[i] = l2;
+	}
+	return &l2[PT_L2_INDEX(va)];
+}
+
+int
+pt_copy(struct pagetable *src, struct pagetable *dst)
+{
+	unsigned i, j, slot;
+	pte_t *l2, *newpte;
+	int result;
+
+	for (i = 0; i < PT_L1_ENTRIES; i++) {
+		l2 = src->pt_dir[i];
+		if (l2 == NULL) {
+			continue;
+		}
+		for (j = 0; j < PT_L2_ENTRIES; j++) {
+			if (l2[j] == 0) {
+				continue;
+			}
+			newpte = pt_lookup(dst, PT_VADDR(i, j), true);
+			if (newpte == NULL) {
+				return ENOMEM;
+			}
+			/*
+			 * Allocating DST's table may have swapped this
+			 * very page out, so only now look at it.
+			 */
+			if (l2[j] & PTE_SHARED) {
+				*newpte = l2[j];
+				coremap_incref(PTE_PADDR(l2[j]));
+			}
+			else if (l2[j] & PTE_VALID) {
+				l2[j] |= PTE_COW;
+				*newpte = l2[j];
+				coremap_incref(PTE_PADDR(l2[j]));
+			}
+			else if (l2[j] & PTE_SWAPPED) {
+				result = swap_dup(PTE_SWAPSLOT(l2[j]), &slot);
+				if (result) {
+					return result;
+				}
+				*newpte = PTE_MKSWAP(slot);
+			}
+		}
+	}
+	return 0;
+}
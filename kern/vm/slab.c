@@ -0,0 +1,288 @@
+/*
+ * Object caches. See slab.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <slab.h>
+
+/*
+ * Slab header, at the start of every slab page. Slabs with free
+ * objects are on their cache's kc_partial list; full slabs are on no
+ * list until something in them is freed.
+ *
+ * The free objects are kept as a stack of their indexes, sl_freeidx,
+ * which sits between the header and the first object, so that free
+ * objects are never written to and keep their constructed state.
+ */
+struct slab {
+	struct kmem_cache *sl_cache;
+	struct slab *sl_next;
+	struct slab *sl_prev;
+	vaddr_t sl_base;		/* first object */
+	uint16_t *sl_freeidx;		/* free stack, sl_nobjs long */
+	unsigned sl_nfree;
+	unsigned sl_inuse;
+	unsigned sl_nobjs;
+};
+
+#define SLAB_OF(obj)  ((struct slab *)((vaddr_t)(obj) & PAGE_FRAME))
+
+/* All caches that have ever had a slab, for kmem_printstats. */
+static struct kmem_cache *kmem_caches;
+static struct spinlock kmem_listlock = SPINLOCK_INITIALIZER;
+
+static
+void
+slab_link(struct kmem_cache *kc, struct slab *sl)
+{
+	KASSERT(spinlock_do_i_hold(&kc->kc_lock));
+
+	sl->sl_prev = NULL;
+	sl->sl_next = kc->kc_partial;
+	if (sl->sl_next != NULL) {
+		sl->sl_next->sl_prev = sl;
+	}
+	kc->kc_partial = sl;
+}
+
+static
+void
+slab_unlink(struct kmem_cache *kc, struct slab *sl)
+{
+	KASSERT(spinlock_do_i_hold(&kc->kc_lock));
+
+	if (sl->sl_prev != NULL) {
+		sl->sl_prev->sl_next = sl->sl_next;
+	}
+	else {
+		KASSERT(kc->kc_partial == sl);
+		kc->kc_partial = sl->sl_next;
+	}
+	if (sl->sl_next != NULL) {
+		sl->sl_next->sl_prev = sl->sl_prev;
+	}
+	sl->sl_next = sl->sl_prev = NULL;
+}
+
+/*
+ * Get a fresh page and carve it into objects. Called without the
+ * cache lock, since it allocates and runs constructors.
+ */
+static
+struct slab *
+slab_create(struct kmem_cache *kc)
+{
+	struct slab *sl;
+	vaddr_t page, base;
+	unsigned i, n;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+
+	/* Each object costs its size plus a slot in the free stack. */
+	n = (PAGE_SIZE - sizeof(struct slab)) / (kc->kc_size + sizeof(uint16_t));
+	base = ROUNDUP(sizeof(struct slab) + n * sizeof(uint16_t), KMEM_ALIGN);
+	if (base + n * kc->kc_size > PAGE_SIZE) {
+		/* Lost it to alignment. */
+		n--;
+	}
+
+	sl = (struct slab *)page;
+	sl->sl_cache = kc;
+	sl->sl_next = sl->sl_prev = NULL;
+	sl->sl_base = page + base;
+	sl->sl_freeidx = (uint16_t *)(page + sizeof(struct slab));
+	sl->sl_inuse = 0;
+	sl->sl_nobjs = n;
+	sl->sl_nfree = n;
+
+	/* Stack the indexes back to front so it hands out in order. */
+	for (i = 0; i < n; i++) {
+		sl->sl_freeidx[i] = n - 1 - i;
+		if (kc->kc_ctor != NULL) {
+			kc->kc_ctor((void *)(sl->sl_base + i * kc->kc_size));
+		}
+	}
+	return sl;
+}
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, void (*ctor)(void *obj))
+{
+	struct kmem_cache *kc;
+
+	kc = kmalloc(sizeof(struct kmem_cache));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_name = name;
+	kc->kc_size = ROUNDUP(size, KMEM_ALIGN);
+	kc->kc_ctor = ctor;
+	spinlock_init(&kc->kc_lock);
+	kc->kc_partial = NULL;
+	kc->kc_empty = NULL;
+	kc->kc_nslabs = 0;
+	kc->kc_inuse = 0;
+	kc->kc_listed = false;
+	kc->kc_next = NULL;
+	return kc;
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **p;
+
+	KASSERT(kc->kc_inuse == 0);
+	KASSERT(kc->kc_partial == NULL);
+
+	if (kc->kc_empty != NULL) {
+		free_kpages((vaddr_t)kc->kc_empty);
+	}
+
+	spinlock_acquire(&kmem_listlock);
+	if (kc->kc_listed) {
+		for (p = &kmem_caches; *p != kc; p = &(*p)->kc_next);
+		*p = kc->kc_next;
+	}
+	spinlock_release(&kmem_listlock);
+
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct slab *sl;
+	void *obj;
+
+	/* Objects must leave room for a few to a slab. */
+	KASSERT(kc->kc_size > 0);
+	KASSERT(kc->kc_size <= (PAGE_SIZE - sizeof(struct slab)) / 2 -
+		KMEM_ALIGN);
+
+	spinlock_acquire(&kc->kc_lock);
+	sl = kc->kc_partial;
+	if (sl == NULL && kc->kc_empty != NULL) {
+		sl = kc->kc_empty;
+		kc->kc_empty = NULL;
+		slab_link(kc, sl);
+	}
+	if (sl == NULL) {
+		/*
+		 * Make a new slab without the lock: alloc_kpages may
+		 * sleep, and may even come back here. Someone else may
+		 * add one meanwhile; that's fine.
+		 */
+		spinlock_release(&kc->kc_lock);
+		sl = slab_create(kc);
+		if (sl == NULL) {
+			return NULL;
+		}
+		if (!kc->kc_listed) {
+			spinlock_acquire(&kmem_listlock);
+			if (!kc->kc_listed) {
+				kc->kc_next = kmem_caches;
+				kmem_caches = kc;
+				kc->kc_listed = true;
+			}
+			spinlock_release(&kmem_listlock);
+		}
+		spinlock_acquire(&kc->kc_lock);
+		kc->kc_nslabs++;
+		slab_link(kc, sl);
+	}
+
+	KASSERT(sl->sl_nfree > 0);
+	sl->sl_nfree--;
+	obj = (void *)(sl->sl_base +
+		       sl->sl_freeidx[sl->sl_nfree] * kc->kc_size);
+	sl->sl_inuse++;
+	kc->kc_inuse++;
+	if (sl->sl_nfree == 0) {
+		/* Full; it comes back when something in it is freed. */
+		slab_unlink(kc, sl);
+	}
+	spinlock_release(&kc->kc_lock);
+
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *ptr)
+{
+	struct slab *sl, *extra;
+	vaddr_t offset;
+
+	sl = SLAB_OF(ptr);
+	offset = (vaddr_t)ptr - sl->sl_base;
+	if (sl->sl_cache != kc || (vaddr_t)ptr < sl->sl_base ||
+	    offset % kc->kc_size != 0) {
+		panic("kmem_cache_free: %p is not from cache %s\n",
+		      ptr, kc->kc_name);
+	}
+
+	/*
+	 * Fill with 0xdeadbeef to catch uses of dangling pointers,
+	 * unless a constructor set the object up for its next user.
+	 */
+	if (kc->kc_ctor == NULL) {
+		uint32_t *w = ptr;
+		size_t i;
+
+		for (i = 0; i < kc->kc_size / sizeof(uint32_t); i++) {
+			w[i] = 0xdeadbeef;
+		}
+	}
+
+	extra = NULL;
+	spinlock_acquire(&kc->kc_lock);
+	KASSERT(sl->sl_inuse > 0);
+	KASSERT(sl->sl_nfree < sl->sl_nobjs);
+	if (sl->sl_nfree == 0) {
+		slab_link(kc, sl);
+	}
+	sl->sl_freeidx[sl->sl_nfree++] = offset / kc->kc_size;
+	sl->sl_inuse--;
+	kc->kc_inuse--;
+
+	if (sl->sl_inuse == 0) {
+		/* Keep one empty slab around to absorb alloc/free churn. */
+		slab_unlink(kc, sl);
+		if (kc->kc_empty == NULL) {
+			kc->kc_empty = sl;
+		}
+		else {
+			extra = sl;
+			kc->kc_nslabs--;
+		}
+	}
+	spinlock_release(&kc->kc_lock);
+
+	if (extra != NULL) {
+		free_kpages((vaddr_t)extra);
+	}
+}
+
+void
+kmem_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	kprintf("Object caches:\n");
+	kprintf("  %-16s %6s %6s %6s\n", "name", "size", "inuse", "slabs");
+
+	spinlock_acquire(&kmem_listlock);
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		kprintf("  %-16s %6lu %6u %6u\n", kc->kc_name,
+			(unsigned long)kc->kc_size, kc->kc_inuse,
+			kc->kc_nslabs);
+	}
+	spinlock_release(&kmem_listlock);
+}
@@ -0,0 +1,161 @@
+/*
+ * Swap space on a raw disk. See swap.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <device.h>
+#include <synch.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <swap.h>
+#include <uw-vmstats.h>
+
+static struct vnode *swap_vnode;
+static struct device *swap_dev;		/* what swap_vnode is a vnode for */
+static struct bitmap *swap_map;
+static unsigned swap_nslots;
+static struct lock *swap_lock;		/* protects swap_map */
+
+void
+swap_bootstrap(void)
+{
+	char path[] = SWAP_DEVICE;
+	struct stat st;
+	int result;
+
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	if (result) {
+		kprintf("swap: cannot open %s: %s; running without swap\n",
+			SWAP_DEVICE, strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result) {
+		panic("swap: cannot stat %s: %s\n", SWAP_DEVICE,
+		      strerror(result));
+	}
+
+	/* A vnode for a device just hands its I/O to the device. */
+	swap_dev = swap_vnode->vn_data;
+	swap_nslots = st.st_size / PAGE_SIZE;
+	swap_map = bitmap_create(swap_nslots);
+	swap_lock = lock_create("swap_lock");
+	if (swap_map == NULL || swap_lock == NULL) {
+		panic("swap: out of memory setting up %s\n", SWAP_DEVICE);
+	}
+
+	kprintf("swap: %u pages on %s\n", swap_nslots, SWAP_DEVICE);
+}
+
+bool
+swap_enabled(void)
+{
+	return swap_vnode != NULL;
+}
+
+int
+swap_alloc(unsigned *slot)
+{
+	int result;
+
+	if (swap_vnode == NULL) {
+		return ENOSPC;
+	}
+
+	lock_acquire(swap_lock);
+	result = bitmap_alloc(swap_map, slot);
+	lock_release(swap_lock);
+	return result;
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	lock_acquire(swap_lock);
+	KASSERT(bitmap_isset(swap_map, slot));
+	bitmap_unmark(swap_map, slot);
+	lock_release(swap_lock);
+}
+
+/*
+ * Move one page between KVA and SLOT.
+ */
+static
+int
+swap_io(unsigned slot, void *kva, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(slot < swap_nslots);
+
+	uio_kinit(&iov, &ku, kva, PAGE_SIZE, (off_t)slot * PAGE_SIZE, rw);
+	result = swap_dev->d_io(swap_dev, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		return EIO;
+	}
+	return 0;
+}
+
+int
+swap_in(unsigned slot, paddr_t pa)
+{
+	vmstats_inc(VMSTAT_SWAP_FILE_READ);
+	return swap_io(slot, (void *)PADDR_TO_KVADDR(pa), UIO_READ);
+}
+
+int
+swap_out(unsigned slot, paddr_t pa)
+{
+	vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+	return swap_io(slot, (void *)PADDR_TO_KVADDR(pa), UIO_WRITE);
+}
+
+int
+swap_dup(unsigned slot, unsigned *newslot)
+{
+	void *buf;
+	int result;
+
+	/* Allocate before taking a slot: this may itself evict a page. */
+	buf = kmalloc(PAGE_SIZE);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	result = swap_alloc(newslot);
+	if (result) {
+		kfree(buf);
+		return result;
+	}
+
+	/*
+	 * Only the write counts: VMSTAT_SWAP_FILE_READ is meant to
+	 * match the page faults that went to swap.
+	 */
+	result = swap_io(slot, buf, UIO_READ);
+	if (result == 0) {
+		vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+		result = swap_io(*newslot, buf, UIO_WRITE);
+	}
+	if (result) {
+		swap_free(*newslot);
+	}
+	kfree(buf);
+	return result;
+}
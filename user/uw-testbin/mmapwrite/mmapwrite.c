@@ -0,0 +1,139 @@
+/*
+ * mmapwrite - shared mappings and write() on the same file
+ *
+ * Writes a file, changes it through a shared mapping, unmaps it,
+ * write()s over part of it, and maps it again: the new mapping must
+ * see both changes. Then, with the file still mapped, it changes one
+ * page through the mapping and write()s another, and checks that the
+ * mapping sees the write and that unmapping doesn't put stale data
+ * back over it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define FILENAME "MMAPWRITE_FILE"
+#define PGSIZE   4096
+#define NPAGES   2
+#define FILESIZE (NPAGES * PGSIZE)
+
+static char buf[FILESIZE];
+
+static
+char *
+map(int fd)
+{
+	void *p;
+
+	p = mmap(NULL, FILESIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	return p;
+}
+
+static
+void
+unmap(char *p)
+{
+	if (munmap(p, FILESIZE) < 0) {
+		err(1, "munmap");
+	}
+}
+
+/* check that P holds C at [START, START+LEN) */
+static
+void
+check(const char *what, const char *p, int start, int len, char c)
+{
+	int i;
+
+	for (i = start; i < start + len; i++) {
+		if (p[i] != c) {
+			errx(1, "%s: byte %d is %d, expected %d",
+			     what, i, p[i], c);
+		}
+	}
+}
+
+/* write LEN bytes of C at POS */
+static
+void
+fill(int fd, off_t pos, int len, char c)
+{
+	int r;
+
+	memset(buf, c, len);
+	if (lseek(fd, pos, SEEK_SET) < 0) {
+		err(1, "lseek");
+	}
+	r = write(fd, buf, len);
+	if (r != len) {
+		err(1, "write");
+	}
+}
+
+/* check the file itself against the same expectation */
+static
+void
+checkfile(int fd, int start, int len, char c)
+{
+	int r;
+
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		err(1, "lseek");
+	}
+	r = read(fd, buf, FILESIZE);
+	if (r != FILESIZE) {
+		err(1, "read");
+	}
+	check("file", buf, start, len, c);
+}
+
+int
+main(void)
+{
+	char *p;
+	int fd;
+
+	fd = open(FILENAME, O_RDWR | O_CREAT | O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", FILENAME);
+	}
+	fill(fd, 0, FILESIZE, 'a');
+
+	/* mmap, dirty a page, munmap, write over it, mmap again */
+	p = map(fd);
+	check("first mapping", p, 0, FILESIZE, 'a');
+	memset(p, 'b', 16);
+	unmap(p);
+
+	fill(fd, 100, 16, 'c');
+
+	p = map(fd);
+	check("second mapping", p, 0, 16, 'b');
+	check("second mapping", p, 100, 16, 'c');
+	check("second mapping", p, 116, FILESIZE - 116, 'a');
+
+	/* with it still mapped, dirty page 0 and write to page 1 */
+	memset(p + 200, 'd', 16);
+	fill(fd, PGSIZE + 300, 16, 'e');
+	check("mapping after write", p, PGSIZE + 300, 16, 'e');
+	check("mapping after write", p, 200, 16, 'd');
+	unmap(p);
+
+	checkfile(fd, 0, 16, 'b');
+	checkfile(fd, 100, 16, 'c');
+	checkfile(fd, 200, 16, 'd');
+	checkfile(fd, PGSIZE + 300, 16, 'e');
+	checkfile(fd, PGSIZE + 316, PGSIZE - 316, 'a');
+
+	close(fd);
+	remove(FILENAME);
+	printf("mmapwrite: passed\n");
+	return 0;
+}
@@ -0,0 +1,169 @@
+/*
+ * pipebench - pipe throughput
+ *
+ * Usage: pipebench [kilobytes [chunksize]]
+ *
+ * A child writes KILOBYTES (default 4096) of a known pattern into a
+ * pipe in CHUNKSIZE (default 512) byte writes; the parent reads it
+ * back in chunks of the same size, checks every byte, and reports how
+ * long it took. It also checks that the reader sees EOF once the
+ * writer is gone, and that writing with no reader fails with EPIPE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#define MAXCHUNK 65536
+
+static char buf[MAXCHUNK];
+
+/* the byte at offset POS in the stream */
+static
+char
+pattern(unsigned long pos)
+{
+	return (char)(pos * 7 + pos / 4093);
+}
+
+static
+void
+writer(int fd, unsigned long total, size_t chunk)
+{
+	unsigned long pos;
+	size_t n, i;
+	ssize_t r;
+
+	for (pos = 0; pos < total; pos += n) {
+		n = chunk;
+		if (n > total - pos) {
+			n = total - pos;
+		}
+		for (i = 0; i < n; i++) {
+			buf[i] = pattern(pos + i);
+		}
+		r = write(fd, buf, n);
+		if (r < 0) {
+			err(1, "write");
+		}
+		if ((size_t)r != n) {
+			errx(1, "write: short count %ld of %lu",
+			     (long)r, (unsigned long)n);
+		}
+	}
+}
+
+static
+unsigned long
+reader(int fd, size_t chunk)
+{
+	unsigned long pos;
+	ssize_t r, i;
+
+	pos = 0;
+	while (1) {
+		r = read(fd, buf, chunk);
+		if (r < 0) {
+			err(1, "read");
+		}
+		if (r == 0) {
+			break;
+		}
+		for (i = 0; i < r; i++) {
+			if (buf[i] != pattern(pos + i)) {
+				errx(1, "wrong data at offset %lu",
+				     pos + i);
+			}
+		}
+		pos += r;
+	}
+	return pos;
+}
+
+static
+void
+check_epipe(void)
+{
+	int fds[2];
+	char c = 0;
+
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+	close(fds[0]);
+	if (write(fds[1], &c, 1) >= 0) {
+		errx(1, "write with no reader succeeded");
+	}
+	if (errno != EPIPE) {
+		err(1, "write with no reader: expected EPIPE, got");
+	}
+	close(fds[1]);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long total, got;
+	size_t chunk;
+	time_t s0, s1;
+	unsigned long ns0, ns1, ms;
+	int fds[2], status;
+	pid_t pid;
+
+	total = 4096;
+	chunk = 512;
+	if (argc > 1) {
+		total = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		chunk = atoi(argv[2]);
+	}
+	if (chunk == 0 || chunk > MAXCHUNK) {
+		errx(1, "chunk size must be between 1 and %d", MAXCHUNK);
+	}
+	total *= 1024;
+
+	check_epipe();
+
+	if (pipe(fds) < 0) {
+		err(1, "pipe");
+	}
+
+	__time(&s0, &ns0);
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		writer(fds[1], total, chunk);
+		close(fds[1]);
+		_exit(0);
+	}
+	close(fds[1]);
+	got = reader(fds[0], chunk);
+	close(fds[0]);
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	__time(&s1, &ns1);
+
+	if (got != total) {
+		errx(1, "read %lu bytes, expected %lu", got, total);
+	}
+	if (WIFEXITED(status) == 0 || WEXITSTATUS(status) != 0) {
+		errx(1, "writer failed");
+	}
+
+	ms = (s1 - s0) * 1000 + ns1 / 1000000 - ns0 / 1000000;
+	if (ms == 0) {
+		ms = 1;
+	}
+	printf("pipebench: %lu KB in %lu-byte chunks: %lu.%03lu s, %lu KB/s\n",
+	       total / 1024, (unsigned long)chunk, ms / 1000, ms % 1000,
+	       (total / 1024) * 1000 / ms);
+	return 0;
+}